@@ -0,0 +1,658 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "inkwave.h"
+#include "internal.h"
+#include "cli.h"
+
+struct batch_file {
+  char* path;
+  char* out_path; // NULL when only verifying
+  char* err; // NULL on success
+  int cached; // output came from the cache
+
+  // run_scan() results
+  int have_header;
+  struct waveform_data_header header;
+  char* xwia; // xwia_len bytes, NULL if there is none
+  uint8_t xwia_len;
+  int crc; // CRC_*
+};
+
+#define CRC_UNCHECKED (0)
+#define CRC_OK        (1)
+#define CRC_BAD       (2)
+
+// bytes read at a time when checking the CRC during a scan
+#define SCAN_CHUNK (64 * 1024)
+
+// kept instead of the message when there is no memory for it
+static const char oom_err[] = "Out of memory";
+
+struct batch {
+  struct batch_file* files;
+  uint32_t count;
+  uint32_t cap;
+  const char* out_template;
+  int out_is_dir;
+  const char* cache_dir;
+  int flags;
+  int check_crc; // run_scan() only
+};
+
+static int add_file(struct batch* batch, const char* path) {
+  struct batch_file* files;
+
+  if(batch->count == batch->cap) {
+    batch->cap = (batch->cap) ? batch->cap * 2 : 64;
+    files = realloc(batch->files, batch->cap * sizeof(struct batch_file));
+    if(!files) {
+      fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+      return -1;
+    }
+    batch->files = files;
+  }
+
+  memset(&batch->files[batch->count], 0, sizeof(struct batch_file));
+  batch->files[batch->count].path = strdup(path);
+  if(!batch->files[batch->count].path) {
+    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+    return -1;
+  }
+  batch->count++;
+
+  return 0;
+}
+
+// Record why `file` failed. It still counts as failed without
+// the memory to keep the message.
+static void set_err(struct batch_file* file, const char* err) {
+  file->err = strdup(err);
+  if(!file->err) {
+    file->err = (char*) oom_err;
+  }
+}
+
+static void free_err(struct batch_file* file) {
+  if(file->err != oom_err) {
+    free(file->err);
+  }
+}
+
+static int has_wbf_extension(const char* path) {
+  size_t len = strlen(path);
+
+  return len >= 4 && strcmp(path + len - 4, ".wbf") == 0;
+}
+
+static int compare_files(const void* a, const void* b) {
+  return strcmp(((const struct batch_file*) a)->path, ((const struct batch_file*) b)->path);
+}
+
+// add all .wbf files in a directory (not recursive)
+static int add_dir(struct batch* batch, const char* dir_path) {
+  DIR* dir;
+  struct dirent* ent;
+  char path[4096];
+  uint32_t first = batch->count;
+
+  dir = opendir(dir_path);
+  if(!dir) {
+    fprintf(stderr, "Opening directory %s failed: %s\n", dir_path, strerror(errno));
+    return -1;
+  }
+
+  while((ent = readdir(dir))) {
+    if(!has_wbf_extension(ent->d_name)) continue;
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+    if(add_file(batch, path) < 0) {
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+
+  // readdir order is arbitrary
+  qsort(batch->files + first, batch->count - first, sizeof(struct batch_file), compare_files);
+  return 0;
+}
+
+// add one file per line from `fd`
+static int add_list(struct batch* batch, FILE* fd) {
+  char line[4096];
+  size_t len;
+
+  while(fgets(line, sizeof(line), fd)) {
+    len = strlen(line);
+    while(len && (line[len-1] == '\n' || line[len-1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if(!len) continue;
+
+    if(add_file(batch, line) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// add files, directories and - (list on stdin)
+static int add_args(struct batch* batch, char** args, int arg_count) {
+  struct stat st;
+  int i, ret;
+
+  for(i=0; i < arg_count; i++) {
+    if(strcmp(args[i], "-") == 0) {
+      ret = add_list(batch, stdin);
+    } else if(stat(args[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      ret = add_dir(batch, args[i]);
+    } else {
+      ret = add_file(batch, args[i]);
+    }
+    if(ret < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Expand the output template for `in_path`.
+// %n is the input file name without extension, %f the input file name
+// and %% a literal %. A directory as template means directory/%n.wrf
+static char* expand_template(const struct batch* batch, const char* in_path) {
+  const char* name;
+  const char* t;
+  size_t name_len;
+  size_t len = 0;
+  char out[4096];
+
+  name = strrchr(in_path, '/');
+  name = (name) ? name + 1 : in_path;
+  name_len = strlen(name);
+  if(has_wbf_extension(name)) {
+    name_len -= 4;
+  }
+
+  if(batch->out_is_dir) {
+    snprintf(out, sizeof(out), "%s/%.*s.wrf", batch->out_template, (int) name_len, name);
+    return strdup(out);
+  }
+
+  for(t = batch->out_template; *t && len < sizeof(out) - 1; t++) {
+    if(*t == '%' && t[1] == 'n') {
+      len += snprintf(out + len, sizeof(out) - len, "%.*s", (int) name_len, name);
+      t++;
+    } else if(*t == '%' && t[1] == 'f') {
+      len += snprintf(out + len, sizeof(out) - len, "%s", name);
+      t++;
+    } else if(*t == '%' && t[1] == '%') {
+      out[len++] = '%';
+      t++;
+    } else {
+      out[len++] = *t;
+    }
+    if(len >= sizeof(out)) {
+      len = sizeof(out) - 1;
+    }
+  }
+  out[len] = '\0';
+
+  return strdup(out);
+}
+
+static int convert_one(struct batch* batch, struct batch_file* file, char* err) {
+  struct inkwave_input input;
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+  char* arena_buf = NULL;
+  size_t arena_size;
+  struct waveform_data_header header;
+  char key[CACHE_KEY_LEN];
+  int ret = -1;
+
+  if(batch->out_template) {
+    file->out_path = expand_template(batch, file->path);
+    if(!file->out_path) {
+      snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+      return -1;
+    }
+  }
+
+  // only the header is read on a hit
+  if(batch->cache_dir && file->out_path) {
+    if(cache_key(file->path, batch->flags, &header, key, err) < 0) {
+      return -1;
+    }
+    ret = cache_fetch(batch->cache_dir, key, &header, file->out_path, err);
+    if(ret != 0) {
+      file->cached = (ret == 1);
+      return (ret == 1) ? 0 : -1;
+    }
+    ret = -1;
+  }
+
+  if(inkwave_input_open(&input, file->path) < 0) {
+    strcpy(err, input.err);
+    return -1;
+  }
+
+  if(input.size < sizeof(struct waveform_data_header)) {
+    snprintf(err, INKWAVE_ERR_LEN, "File too small to contain a waveform header");
+    goto out;
+  }
+
+  arena_size = inkwave_arena_size((const struct waveform_data_header*) input.data);
+  arena_buf = malloc(arena_size);
+  if(!arena_buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  inkwave_arena_init(&arena, arena_buf, arena_size);
+
+  if(inkwave_parse_wbf(&model, &arena, input.data, input.size) < 0) {
+    strcpy(err, model.err);
+    goto out;
+  }
+
+  // parallelism is across files so each file gets one thread
+  if(file->out_path && batch->cache_dir) {
+    if(cache_store(batch->cache_dir, key, &model, batch->flags, 1, file->out_path, err) < 0) {
+      goto out;
+    }
+  } else if(file->out_path) {
+    if(write_wrf(&model, batch->flags, 1, file->out_path, err) < 0) {
+      goto out;
+    }
+  }
+
+  ret = 0;
+
+ out:
+  free(arena_buf);
+  inkwave_input_close(&input);
+  return ret;
+}
+
+static void batch_job(void* arg, uint32_t job) {
+  struct batch* batch = arg;
+  struct batch_file* file = &batch->files[job];
+  char err[INKWAVE_ERR_LEN];
+
+  if(convert_one(batch, file, err) < 0) {
+    set_err(file, err);
+  }
+}
+
+int run_batch(char** args, int arg_count, const char* out_template, const char* cache_dir, int flags, int threads) {
+  struct batch batch;
+  struct stat st;
+  uint32_t i;
+  uint32_t failed = 0;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.out_template = out_template;
+  batch.cache_dir = cache_dir;
+  batch.flags = flags;
+
+  if(out_template && stat(out_template, &st) == 0 && S_ISDIR(st.st_mode)) {
+    batch.out_is_dir = 1;
+  }
+
+  if(add_args(&batch, args, arg_count) < 0) {
+    failed = 1;
+    goto out;
+  }
+
+  run_parallel(threads, batch.count, batch_job, &batch);
+
+  for(i=0; i < batch.count; i++) {
+    if(batch.files[i].err) {
+      failed++;
+      printf("FAILED  %s: %s\n", batch.files[i].path, batch.files[i].err);
+    } else if(batch.files[i].out_path) {
+      printf("OK      %s -> %s%s\n", batch.files[i].path, batch.files[i].out_path,
+             (batch.files[i].cached) ? " (cached)" : "");
+    } else {
+      printf("OK      %s\n", batch.files[i].path);
+    }
+  }
+  printf("\n%u files, %u ok, %u failed\n", batch.count, batch.count - failed, failed);
+
+ out:
+  for(i=0; i < batch.count; i++) {
+    free(batch.files[i].path);
+    free(batch.files[i].out_path);
+    free_err(&batch.files[i]);
+  }
+  free(batch.files);
+
+  return failed;
+}
+
+static ssize_t pread_full(int fd, void* buf, size_t len, off_t offset) {
+  ssize_t ret;
+
+  do {
+    ret = pread(fd, buf, len, offset);
+  } while(ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+// CRC-32 of the whole file with the checksum field counted as zero
+static int scan_crc(int fd, const struct waveform_data_header* header, uint32_t* crc, char* err) {
+  char buf[SCAN_CHUNK];
+  const char zero[4] = {0};
+  size_t done, len;
+  ssize_t ret;
+
+  *crc = inkwave_crc32(0, zero, 4);
+  for(done=4; done < header->filesize; done += ret) {
+    len = header->filesize - done;
+    if(len > sizeof(buf)) {
+      len = sizeof(buf);
+    }
+    ret = pread_full(fd, buf, len, done);
+    if(ret < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Reading file failed: %s", strerror(errno));
+      return -1;
+    }
+    if(ret == 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "File ends before the file size reported by waveform header");
+      return -1;
+    }
+    *crc = inkwave_crc32(*crc, buf, ret);
+  }
+
+  return 0;
+}
+
+// Read the header and xwia, and with check_crc the whole file.
+static int scan_one(struct batch* batch, struct batch_file* file, char* err) {
+  struct waveform_data_header* header = &file->header;
+  uint8_t xwia[1 + 255 + 1]; // length, data, checksum
+  uint8_t checksum;
+  uint32_t crc;
+  struct stat st;
+  ssize_t ret;
+  int fd, i;
+
+  fd = open(file->path, O_RDONLY);
+  if(fd < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file failed: %s", strerror(errno));
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error getting file size: %s", strerror(errno));
+    goto fail;
+  }
+
+  ret = pread_full(fd, header, sizeof(*header), 0);
+  if(ret < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Reading file failed: %s", strerror(errno));
+    goto fail;
+  }
+  if(ret != sizeof(*header)) {
+    snprintf(err, INKWAVE_ERR_LEN, "File too small to contain a waveform header");
+    goto fail;
+  }
+  file->have_header = 1;
+
+  if(S_ISREG(st.st_mode) && (off_t) header->filesize != st.st_size) {
+    snprintf(err, INKWAVE_ERR_LEN, "Actual file size does not match file size reported by waveform header");
+    goto fail;
+  }
+
+  // if xwia is 0 then there is no xwia info
+  if(header->xwia) {
+    ret = pread_full(fd, xwia, sizeof(xwia), header->xwia);
+    if(ret < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Reading file failed: %s", strerror(errno));
+      goto fail;
+    }
+    if(ret < 2 || ret < xwia[0] + 2) {
+      snprintf(err, INKWAVE_ERR_LEN, "xwia outside of file");
+      goto fail;
+    }
+    checksum = 0;
+    for(i=0; i <= xwia[0]; i++) {
+      checksum += xwia[i];
+    }
+    if(checksum != xwia[xwia[0] + 1]) {
+      snprintf(err, INKWAVE_ERR_LEN, "xwia checksum error");
+      goto fail;
+    }
+    file->xwia_len = xwia[0];
+    file->xwia = malloc(xwia[0] + 1);
+    if(!file->xwia) {
+      snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+      goto fail;
+    }
+    memcpy(file->xwia, xwia + 1, xwia[0]);
+  }
+
+  if(batch->check_crc) {
+    if(scan_crc(fd, header, &crc, err) < 0) {
+      goto fail;
+    }
+    file->crc = (crc == header->checksum) ? CRC_OK : CRC_BAD;
+    if(file->crc == CRC_BAD) {
+      snprintf(err, INKWAVE_ERR_LEN, "Checksum error");
+      goto fail;
+    }
+  }
+
+  close(fd);
+  return 0;
+
+ fail:
+  close(fd);
+  return -1;
+}
+
+static void scan_job(void* arg, uint32_t job) {
+  struct batch* batch = arg;
+  struct batch_file* file = &batch->files[job];
+  char err[INKWAVE_ERR_LEN];
+
+  if(scan_one(batch, file, err) < 0) {
+    set_err(file, err);
+  }
+}
+
+static void put_csv(const char* str) {
+  const char* c;
+
+  if(!strpbrk(str, ",\"\r\n")) {
+    fputs(str, stdout);
+    return;
+  }
+  putchar('"');
+  for(c = str; *c; c++) {
+    if(*c == '"') {
+      putchar('"');
+    }
+    putchar(*c);
+  }
+  putchar('"');
+}
+
+static void put_json(const char* str) {
+  const unsigned char* c;
+
+  putchar('"');
+  for(c = (const unsigned char*) str; *c; c++) {
+    if(*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if(*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+// A column of a scan row. With `names` set the CSV header is printed
+// instead. A NULL `val` is an empty CSV field or null in JSON.
+static void put_field(int format, int names, int* first, const char* name, const char* val, int is_num) {
+  if(format == SCAN_JSON) {
+    printf("%s\"%s\": ", (*first) ? "{" : ", ", name);
+    if(!val) {
+      fputs("null", stdout);
+    } else if(is_num) {
+      fputs(val, stdout);
+    } else {
+      put_json(val);
+    }
+  } else {
+    if(!*first) {
+      putchar(',');
+    }
+    if(names) {
+      fputs(name, stdout);
+    } else if(val) {
+      put_csv(val);
+    }
+  }
+  *first = 0;
+}
+
+static void put_str(int format, int names, int* first, const char* name, const char* val) {
+  put_field(format, names, first, name, val, 0);
+}
+
+static void put_num(int format, int names, int* first, const char* name, unsigned int val, int valid) {
+  char buf[16];
+
+  snprintf(buf, sizeof(buf), "%u", val);
+  put_field(format, names, first, name, (valid) ? buf : NULL, 1);
+}
+
+// hex codes are strings in JSON
+static void put_hex(int format, int names, int* first, const char* name, int digits, unsigned int val, int valid) {
+  char buf[16];
+
+  snprintf(buf, sizeof(buf), "0x%0*x", digits, val);
+  put_field(format, names, first, name, (valid) ? buf : NULL, 0);
+}
+
+// the xwia with unprintable bytes as \xNN
+static void format_xwia(const struct batch_file* file, char* out) {
+  uint8_t i;
+
+  for(i=0; i < file->xwia_len; i++) {
+    if(isprint((unsigned char) file->xwia[i]) && file->xwia[i] != '\\') {
+      *out++ = file->xwia[i];
+    } else {
+      out += sprintf(out, "\\x%02x", (uint8_t) file->xwia[i]);
+    }
+  }
+  *out = '\0';
+}
+
+// print one row, or the CSV header if file is NULL
+static void print_scan_row(int format, const struct batch_file* file) {
+  const struct waveform_data_header* h = (file) ? &file->header : NULL;
+  int names = !file;
+  int ok = file && file->have_header;
+  int first = 1;
+  char xwia[255 * 4 + 1];
+  const char* crc = NULL;
+  int bias, rev;
+
+  if(file && file->crc != CRC_UNCHECKED) {
+    crc = (file->crc == CRC_OK) ? "ok" : "bad";
+  }
+  if(file && file->xwia) {
+    format_xwia(file, xwia);
+  }
+
+  // as in print_header()
+  bias = ok && h->waveform_type <= 0x15;
+  rev = ok && h->waveform_type >= 0x2B;
+
+  put_str(format, names, &first, "path", (file) ? file->path : NULL);
+  put_str(format, names, &first, "status", (file) ? ((file->err) ? "failed" : "ok") : NULL);
+  put_str(format, names, &first, "error", (file) ? file->err : NULL);
+  put_num(format, names, &first, "file_size", (ok) ? h->filesize : 0, ok);
+  put_hex(format, names, &first, "checksum", 8, (ok) ? h->checksum : 0, ok);
+  put_str(format, names, &first, "crc", crc);
+  put_num(format, names, &first, "serial", (ok) ? h->serial : 0, ok);
+  put_hex(format, names, &first, "run_type", 1, (ok) ? h->run_type : 0, ok);
+  put_str(format, names, &first, "run_type_desc", (ok) ? get_desc(run_types, h->run_type, NULL) : NULL);
+  put_hex(format, names, &first, "mfg_code", 1, (ok) ? h->mfg_code : 0, ok);
+  put_str(format, names, &first, "mfg_code_desc", (ok) ? get_desc_mfg_code(h->mfg_code) : NULL);
+  put_hex(format, names, &first, "fpl_platform", 1, (ok) ? h->fpl_platform : 0, ok);
+  put_str(format, names, &first, "fpl_platform_desc", (ok) ? get_desc(fpl_platforms, h->fpl_platform, NULL) : NULL);
+  put_num(format, names, &first, "fpl_lot", (ok) ? h->fpl_lot : 0, ok);
+  put_hex(format, names, &first, "fpl_size", 1, (ok) ? h->fpl_size : 0, ok);
+  put_str(format, names, &first, "fpl_size_desc", (ok) ? get_desc(fpl_sizes, h->fpl_size, NULL) : NULL);
+  put_hex(format, names, &first, "fpl_rate", 1, (ok) ? h->fpl_rate : 0, ok);
+  put_str(format, names, &first, "fpl_rate_desc", (ok) ? get_desc(fpl_rates, h->fpl_rate, NULL) : NULL);
+  put_num(format, names, &first, "waveform_version", (ok) ? h->waveform_version : 0, ok);
+  put_num(format, names, &first, "waveform_subversion", (ok) ? h->waveform_subversion : 0, ok);
+  put_hex(format, names, &first, "waveform_type", 1, (ok) ? h->waveform_type : 0, ok);
+  put_str(format, names, &first, "waveform_type_desc", (ok) ? get_desc(waveform_types, h->waveform_type, NULL) : NULL);
+  put_str(format, names, &first, "tuning_bias", (bias) ? get_desc(waveform_tuning_biases, h->waveform_tuning_bias_or_rev, NULL) : NULL);
+  put_num(format, names, &first, "revision", (rev) ? h->waveform_tuning_bias_or_rev : 0, rev);
+  put_num(format, names, &first, "adhesive_run", (ok) ? h->mode_version_or_adhesive_run_num : 0, ok && h->fpl_platform < 3);
+  put_hex(format, names, &first, "mode_version", 1, (ok) ? h->mode_version_or_adhesive_run_num : 0, ok && h->fpl_platform >= 3);
+  put_str(format, names, &first, "mode_version_desc", (ok && h->fpl_platform >= 3) ? get_desc(mode_versions, h->mode_version_or_adhesive_run_num, NULL) : NULL);
+  put_num(format, names, &first, "modes", (ok) ? h->mc + 1 : 0, ok);
+  put_num(format, names, &first, "temp_ranges", (ok) ? h->trc + 1 : 0, ok);
+  put_num(format, names, &first, "bits_per_pixel", (ok) ? get_bits_per_pixel(h) : 0, ok);
+  put_str(format, names, &first, "xwia", (file && file->xwia) ? xwia : NULL);
+
+  printf("%s\n", (format == SCAN_JSON) ? "}" : "");
+}
+
+int run_scan(char** args, int arg_count, int format, int check_crc, int threads) {
+  struct batch batch;
+  uint32_t i;
+  uint32_t failed = 0;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.check_crc = check_crc;
+
+  if(add_args(&batch, args, arg_count) < 0) {
+    failed = 1;
+    goto out;
+  }
+
+  run_parallel(threads, batch.count, scan_job, &batch);
+
+  if(format == SCAN_CSV) {
+    print_scan_row(format, NULL);
+  }
+  for(i=0; i < batch.count; i++) {
+    if(batch.files[i].err) {
+      failed++;
+    }
+    print_scan_row(format, &batch.files[i]);
+  }
+  fprintf(stderr, "%u files, %u ok, %u failed\n", batch.count, batch.count - failed, failed);
+
+ out:
+  for(i=0; i < batch.count; i++) {
+    free(batch.files[i].path);
+    free(batch.files[i].xwia);
+    free_err(&batch.files[i]);
+  }
+  free(batch.files);
+
+  return failed;
+}
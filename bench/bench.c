@@ -0,0 +1,411 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "inkwave.h"
+
+// Times each stage of a conversion on every given .wbf file and prints
+// one line per (file, stage): the best of several runs in nanoseconds
+// and the throughput over the input size. With -b the results are
+// compared against a baseline written earlier with -o and stages that
+// got slower by more than the threshold are reported as regressions.
+
+#define BENCH_NAME_LEN (256)
+
+struct bench_result {
+  char file[BENCH_NAME_LEN];
+  char stage[32];
+  uint64_t ns;
+  uint64_t bytes;
+};
+
+struct bench_results {
+  struct bench_result* results;
+  uint32_t count;
+  uint32_t cap;
+};
+
+struct bench_file {
+  const char* name;
+  struct inkwave_input input;
+  char* arena_buf;
+  size_t arena_size;
+  struct inkwave_model model; // parsed once for stage_decode()
+  char* model_arena_buf;
+  char* states;
+  char* wrf;
+  size_t wrf_size;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char* base_name(const char* path) {
+  const char* slash = strrchr(path, '/');
+
+  return (slash) ? slash + 1 : path;
+}
+
+static int add_result(struct bench_results* res, const char* file, const char* stage, uint64_t ns, uint64_t bytes) {
+  struct bench_result* r;
+
+  if(res->count == res->cap) {
+    res->cap = (res->cap) ? res->cap * 2 : 64;
+    r = realloc(res->results, res->cap * sizeof(struct bench_result));
+    if(!r) {
+      fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+      return -1;
+    }
+    res->results = r;
+  }
+
+  r = &res->results[res->count++];
+  snprintf(r->file, sizeof(r->file), "%s", file);
+  snprintf(r->stage, sizeof(r->stage), "%s", stage);
+  r->ns = ns;
+  r->bytes = bytes;
+  return 0;
+}
+
+static const struct bench_result* find_result(const struct bench_results* res, const char* file, const char* stage) {
+  uint32_t i;
+
+  for(i=0; i < res->count; i++) {
+    if(strcmp(res->results[i].file, file) == 0 && strcmp(res->results[i].stage, stage) == 0) {
+      return &res->results[i];
+    }
+  }
+  return NULL;
+}
+
+// Read results in the format written by write_results(). Lines
+// starting with # are comments.
+static int read_results(struct bench_results* res, const char* path) {
+  char line[512];
+  char file[BENCH_NAME_LEN];
+  char stage[32];
+  unsigned long long ns, bytes;
+  FILE* fd;
+
+  fd = fopen(path, "r");
+  if(!fd) {
+    fprintf(stderr, "Opening baseline %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), fd)) {
+    if(line[0] == '#') {
+      continue;
+    }
+    if(sscanf(line, "%255s %31s %llu %llu", file, stage, &ns, &bytes) != 4) {
+      continue;
+    }
+    if(add_result(res, file, stage, ns, bytes) < 0) {
+      fclose(fd);
+      return -1;
+    }
+  }
+
+  fclose(fd);
+  return 0;
+}
+
+static int write_results(const struct bench_results* res, const char* path) {
+  FILE* fd;
+  uint32_t i;
+
+  fd = fopen(path, "w");
+  if(!fd) {
+    fprintf(stderr, "Opening file %s for writing failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fprintf(fd, "# file stage best_ns input_bytes\n");
+  for(i=0; i < res->count; i++) {
+    fprintf(fd, "%s %s %llu %llu\n", res->results[i].file, res->results[i].stage,
+            (unsigned long long) res->results[i].ns, (unsigned long long) res->results[i].bytes);
+  }
+
+  if(fclose(fd) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// the CRC-32 of the whole file as checked by inkwave_parse_wbf()
+static int stage_crc(struct bench_file* f) {
+  static const char zero[4] = {0, 0, 0, 0};
+  volatile uint32_t crc;
+
+  crc = inkwave_crc32(0, zero, sizeof(zero));
+  crc = inkwave_crc32(crc, f->input.data + sizeof(zero), f->input.size - sizeof(zero));
+  (void) crc;
+  return 0;
+}
+
+// validating and indexing the pointer tables
+static int stage_tables(struct bench_file* f) {
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+
+  inkwave_arena_init(&arena, f->arena_buf, f->arena_size);
+  if(inkwave_open_wbf(&model, &arena, f->input.data, f->input.size) < 0) {
+    fprintf(stderr, "%s: %s\n", f->name, model.err);
+    return -1;
+  }
+  return 0;
+}
+
+// decoding every unique waveform of an already parsed file
+static int stage_decode(struct bench_file* f) {
+  uint32_t i;
+
+  for(i=0; i < f->model.waveform_count; i++) {
+    inkwave_decode_waveform(&f->model, &f->model.waveforms[i], f->states);
+  }
+  return 0;
+}
+
+// the whole in-memory conversion from .wbf to .wrf on one thread
+static int stage_convert(struct bench_file* f) {
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+
+  inkwave_arena_init(&arena, f->arena_buf, f->arena_size);
+  if(inkwave_parse_wbf(&model, &arena, f->input.data, f->input.size) < 0
+     || inkwave_build_wrf(&model, 0, f->wrf, f->wrf_size) < 0) {
+    fprintf(stderr, "%s: %s\n", f->name, model.err);
+    return -1;
+  }
+  return 0;
+}
+
+struct bench_stage {
+  const char* name;
+  int (*fn)(struct bench_file* f);
+};
+
+static const struct bench_stage stages[] = {
+  {"crc", stage_crc},
+  {"tables", stage_tables},
+  {"decode", stage_decode},
+  {"convert", stage_convert},
+};
+
+// Map the file and size every buffer the stages need once up front
+// so only the work itself is timed.
+static int open_file(struct bench_file* f, const char* path) {
+  struct inkwave_arena arena;
+  struct inkwave_model* model = &f->model;
+  uint32_t max_states = 0;
+  uint32_t i;
+
+  memset(f, 0, sizeof(struct bench_file));
+  f->name = base_name(path);
+
+  if(inkwave_input_open(&f->input, path) < 0) {
+    fprintf(stderr, "%s\n", f->input.err);
+    return -1;
+  }
+  if(f->input.size < sizeof(struct waveform_data_header)) {
+    fprintf(stderr, "%s: File too small to contain a waveform header\n", path);
+    return -1;
+  }
+
+  f->arena_size = inkwave_arena_size((const struct waveform_data_header*) f->input.data);
+  f->arena_buf = malloc(f->arena_size);
+  f->model_arena_buf = malloc(f->arena_size);
+  if(!f->arena_buf || !f->model_arena_buf) {
+    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+    return -1;
+  }
+
+  inkwave_arena_init(&arena, f->model_arena_buf, f->arena_size);
+  if(inkwave_parse_wbf(model, &arena, f->input.data, f->input.size) < 0) {
+    fprintf(stderr, "%s: %s\n", path, model->err);
+    return -1;
+  }
+
+  for(i=0; i < model->waveform_count; i++) {
+    if(model->waveforms[i].state_count > max_states) {
+      max_states = model->waveforms[i].state_count;
+    }
+  }
+
+  f->wrf_size = inkwave_wrf_size(model, 0);
+  f->states = malloc(max_states + 1);
+  f->wrf = malloc(f->wrf_size);
+  if(!f->states || !f->wrf) {
+    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void close_file(struct bench_file* f) {
+  inkwave_input_close(&f->input);
+  free(f->arena_buf);
+  free(f->model_arena_buf);
+  free(f->states);
+  free(f->wrf);
+}
+
+// Best time of `reps` runs of a stage. Runs are repeated until at least
+// `reps` runs and 50ms have passed so tiny files still time reliably.
+static int run_stage(const struct bench_stage* stage, struct bench_file* f, int reps, uint64_t* best) {
+  uint64_t start, elapsed, total = 0;
+  int i;
+
+  *best = UINT64_MAX;
+  for(i=0; i < reps || total < 50000000; i++) {
+    start = now_ns();
+    if(stage->fn(f) < 0) {
+      return -1;
+    }
+    elapsed = now_ns() - start;
+    total += elapsed;
+    if(elapsed < *best) {
+      *best = elapsed;
+    }
+  }
+  return 0;
+}
+
+void usage(FILE* fd) {
+  fprintf(fd, "\n");
+  fprintf(fd, "Usage: bench [-n reps] [-o results] [-b baseline] [-T pct] file.wbf ...\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  Time the CRC, table parsing, decoding and conversion\n");
+  fprintf(fd, "  of each .wbf file.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "Options:\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -n reps: Runs per stage, the best one counts\n");
+  fprintf(fd, "           (default 20).\n");
+  fprintf(fd, "  -o file: Write the results to a file that can\n");
+  fprintf(fd, "           later be used as baseline.\n");
+  fprintf(fd, "  -b file: Compare against a baseline. Exits with 1\n");
+  fprintf(fd, "           if any stage got slower by more than\n");
+  fprintf(fd, "           the threshold.\n");
+  fprintf(fd, "  -T pct: Regression threshold in percent\n");
+  fprintf(fd, "          (default 10).\n");
+  fprintf(fd, "  -h: Display this help message.\n");
+  fprintf(fd, "\n");
+}
+
+int main(int argc, char **argv) {
+  struct bench_results results = {NULL, 0, 0};
+  struct bench_results baseline = {NULL, 0, 0};
+  const struct bench_result* base;
+  struct bench_file f;
+  char* out_path = NULL;
+  char* baseline_path = NULL;
+  double threshold = 10;
+  double change;
+  int reps = 20;
+  int regressions = 0;
+  uint64_t best;
+  uint32_t s;
+  int i, c;
+  int ret = 1;
+
+  while((c = getopt(argc, argv, "n:o:b:T:h")) != -1) {
+    switch(c) {
+    case 'n':
+      reps = atoi(optarg);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 'T':
+      threshold = atof(optarg);
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+
+  if(optind == argc || reps < 1) {
+    usage(stderr);
+    return 1;
+  }
+
+  if(baseline_path && read_results(&baseline, baseline_path) < 0) {
+    return 1;
+  }
+
+  printf("%-20s %-8s %12s %10s", "file", "stage", "best_ns", "MB/s");
+  if(baseline_path) {
+    printf(" %12s %8s", "baseline_ns", "change");
+  }
+  printf("\n");
+
+  for(i=optind; i < argc; i++) {
+    if(open_file(&f, argv[i]) < 0) {
+      close_file(&f);
+      goto out;
+    }
+
+    for(s=0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+      if(run_stage(&stages[s], &f, reps, &best) < 0) {
+        close_file(&f);
+        goto out;
+      }
+      if(add_result(&results, f.name, stages[s].name, best, f.input.size) < 0) {
+        close_file(&f);
+        goto out;
+      }
+
+      printf("%-20s %-8s %12llu %10.1f", f.name, stages[s].name,
+             (unsigned long long) best, (best) ? f.input.size * 1e3 / best : 0.0);
+
+      base = (baseline_path) ? find_result(&baseline, f.name, stages[s].name) : NULL;
+      if(base && base->ns) {
+        change = ((double) best - base->ns) * 100 / base->ns;
+        printf(" %12llu %+7.1f%%", (unsigned long long) base->ns, change);
+        if(change > threshold) {
+          printf(" REGRESSION");
+          regressions++;
+        }
+      } else if(baseline_path) {
+        printf(" %12s %8s", "-", "new");
+      }
+      printf("\n");
+    }
+
+    close_file(&f);
+  }
+
+  if(out_path && write_results(&results, out_path) < 0) {
+    goto out;
+  }
+
+  if(regressions) {
+    fprintf(stderr, "%d stages slower than the baseline by more than %.1f%%\n", regressions, threshold);
+    goto out;
+  }
+
+  ret = 0;
+
+ out:
+  free(results.results);
+  free(baseline.results);
+  return ret;
+}
@@ -0,0 +1,359 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "inkwave.h"
+
+// Writes a synthetic but valid .wbf file: header with file size, CRC-32
+// and header checksums, temperature range table, xwia, mode and
+// temperature range pointer tables and run-length encoded waveforms.
+// The states themselves are random, only the structure is realistic.
+
+// pointers are 24 bits
+#define WBF_MAX_SIZE (0xffffff)
+
+struct wbf_buf {
+  uint8_t* data;
+  size_t len;
+  size_t cap;
+};
+
+struct gen_params {
+  uint32_t modes;
+  uint32_t temp_ranges;
+  uint32_t min_phases;
+  uint32_t max_phases;
+  uint32_t run_len; // average packed bytes per run
+  uint32_t literal_pct; // chance of a literal section instead of a run
+  uint32_t share_pct; // chance of reusing an earlier waveform
+  uint32_t bpp5;
+  uint64_t seed;
+};
+
+static uint64_t rng_state;
+
+// xorshift64*, the same sequence on every platform for a given seed
+static uint32_t rnd(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// uniform in [lo, hi]
+static uint32_t rnd_range(uint32_t lo, uint32_t hi) {
+  return lo + rnd() % (hi - lo + 1);
+}
+
+// a packed byte that isn't the 0xfc tag
+static uint8_t rnd_pattern(void) {
+  uint8_t b;
+
+  while((b = rnd()) == 0xfc);
+  return b;
+}
+
+static int put(struct wbf_buf* buf, const void* data, size_t len) {
+  uint8_t* p;
+
+  if(buf->len + len > WBF_MAX_SIZE) {
+    fprintf(stderr, "Generated file would exceed %u bytes, use fewer or shorter waveforms\n", WBF_MAX_SIZE);
+    return -1;
+  }
+  if(buf->len + len > buf->cap) {
+    buf->cap = (buf->cap) ? buf->cap * 2 : 64 * 1024;
+    if(buf->cap < buf->len + len) {
+      buf->cap = buf->len + len;
+    }
+    p = realloc(buf->data, buf->cap);
+    if(!p) {
+      fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+      return -1;
+    }
+    buf->data = p;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+static int put_byte(struct wbf_buf* buf, uint8_t b) {
+  return put(buf, &b, 1);
+}
+
+// 24 bit address followed by the sum of its bytes
+static void set_pointer(struct wbf_buf* buf, size_t at, uint32_t addr) {
+  buf->data[at] = addr & 0xff;
+  buf->data[at + 1] = (addr >> 8) & 0xff;
+  buf->data[at + 2] = (addr >> 16) & 0xff;
+  buf->data[at + 3] = buf->data[at] + buf->data[at + 1] + buf->data[at + 2];
+}
+
+// Append one waveform of a random number of phases as a mix of
+// (pattern, count) runs and 0xfc delimited literal sections.
+static int put_waveform(struct wbf_buf* buf, const struct gen_params* params) {
+  uint32_t phase_bytes = (params->bpp5) ? 1024 / 4 : 256 / 4;
+  uint32_t left = rnd_range(params->min_phases, params->max_phases) * phase_bytes;
+  uint32_t n, i;
+
+  while(left) {
+    if(rnd() % 100 < params->literal_pct) {
+      n = rnd_range(1, 16);
+      n = (n < left) ? n : left;
+      if(put_byte(buf, 0xfc) < 0) {
+        return -1;
+      }
+      for(i=0; i < n; i++) {
+        if(put_byte(buf, rnd_pattern()) < 0) {
+          return -1;
+        }
+      }
+      if(put_byte(buf, 0xfc) < 0) {
+        return -1;
+      }
+    } else {
+      n = rnd_range(1, 2 * params->run_len - 1);
+      n = (n < 256) ? n : 256;
+      n = (n < left) ? n : left;
+      if(put_byte(buf, rnd_pattern()) < 0 || put_byte(buf, n - 1) < 0) {
+        return -1;
+      }
+    }
+    left -= n;
+  }
+
+  // the two trailing bytes every waveform ends with, see README.md
+  if(put_byte(buf, 0xff) < 0 || put_byte(buf, rnd()) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int generate(struct wbf_buf* buf, const struct gen_params* params) {
+  static const char xwia[] = "inkwave synthetic waveform";
+  struct waveform_data_header header;
+  uint32_t* addrs;
+  uint32_t addr_count = 0;
+  uint32_t i, m, t;
+  size_t mode_table, tr_table;
+  uint8_t sum;
+  uint8_t temp;
+  uint32_t crc;
+
+  memset(&header, 0, sizeof(header));
+  if(put(buf, &header, sizeof(header)) < 0) {
+    return -1;
+  }
+
+  // ascending temperature range bounds and their checksum
+  sum = 0;
+  for(i=0; i < params->temp_ranges + 1; i++) {
+    temp = (i * 256) / (params->temp_ranges + 1);
+    sum += temp;
+    if(put_byte(buf, temp) < 0) {
+      return -1;
+    }
+  }
+  if(put_byte(buf, sum) < 0) {
+    return -1;
+  }
+
+  header.xwia = buf->len;
+  sum = sizeof(xwia) - 1;
+  for(i=0; i < sizeof(xwia) - 1; i++) {
+    sum += xwia[i];
+  }
+  if(put_byte(buf, sizeof(xwia) - 1) < 0 || put(buf, xwia, sizeof(xwia) - 1) < 0 || put_byte(buf, sum) < 0) {
+    return -1;
+  }
+
+  // the mode table directly follows the xwia, then all temperature
+  // range tables and then the waveforms, as in real files
+  mode_table = buf->len;
+  for(i=0; i < params->modes * (1 + params->temp_ranges) * 4; i++) {
+    if(put_byte(buf, 0) < 0) {
+      return -1;
+    }
+  }
+
+  addrs = malloc(params->modes * params->temp_ranges * sizeof(uint32_t));
+  if(!addrs) {
+    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for(m=0; m < params->modes; m++) {
+    tr_table = mode_table + (params->modes + m * params->temp_ranges) * 4;
+    set_pointer(buf, mode_table + 4 * m, tr_table);
+
+    for(t=0; t < params->temp_ranges; t++) {
+      if(addr_count && rnd() % 100 < params->share_pct) {
+        set_pointer(buf, tr_table + 4 * t, addrs[rnd() % addr_count]);
+        continue;
+      }
+      addrs[addr_count++] = buf->len;
+      set_pointer(buf, tr_table + 4 * t, buf->len);
+      if(put_waveform(buf, params) < 0) {
+        goto fail;
+      }
+    }
+  }
+  free(addrs);
+
+  header.filesize = buf->len;
+  header.serial = params->seed;
+  header.run_type = 0x02;
+  header.fpl_platform = 0x06;
+  header.fpl_lot = 1;
+  header.mode_version_or_adhesive_run_num = 0x03;
+  header.waveform_version = 1;
+  header.fpl_size = 0x3c;
+  header.fpl_rate = 0x85;
+  header.luts = (params->bpp5) ? 0x04 : 0x00;
+  header.mc = params->modes - 1;
+  header.trc = params->temp_ranges - 1;
+  memcpy(buf->data, &header, sizeof(header));
+
+  // header checksums over bytes 8 to 30 and 32 to 46
+  sum = 0;
+  for(i=8; i < 31; i++) {
+    sum += buf->data[i];
+  }
+  buf->data[31] = sum;
+  sum = 0;
+  for(i=32; i < 47; i++) {
+    sum += buf->data[i];
+  }
+  buf->data[47] = sum;
+
+  // the file checksum is computed with the checksum field zeroed
+  crc = inkwave_crc32(0, (const char*) buf->data, buf->len);
+  memcpy(buf->data, &crc, sizeof(crc));
+
+  return 0;
+
+ fail:
+  free(addrs);
+  return -1;
+}
+
+void usage(FILE* fd) {
+  fprintf(fd, "\n");
+  fprintf(fd, "Usage: wbfgen [-m modes] [-t ranges] [-p min,max] [-r run] [-l pct] [-S pct] [-5] [-s seed] -o out.wbf\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  Write a synthetic .wbf file for benchmarking.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "Options:\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -m modes: Number of modes (1 to 256, default 8).\n");
+  fprintf(fd, "  -t ranges: Number of temperature ranges\n");
+  fprintf(fd, "             (1 to 256, default 14).\n");
+  fprintf(fd, "  -p min,max: Phases per waveform (default 20,60).\n");
+  fprintf(fd, "  -r run: Average packed bytes per run\n");
+  fprintf(fd, "          (1 to 256, default 8).\n");
+  fprintf(fd, "  -l pct: Percentage of literal (0xfc) sections\n");
+  fprintf(fd, "          instead of runs (default 20).\n");
+  fprintf(fd, "  -S pct: Percentage of (mode, temperature range)\n");
+  fprintf(fd, "          pairs that reuse an earlier waveform\n");
+  fprintf(fd, "          (default 30).\n");
+  fprintf(fd, "  -5: Use 5 bits per pixel.\n");
+  fprintf(fd, "  -s seed: Random seed (default 1).\n");
+  fprintf(fd, "  -o file: Output file. Use - for stdout.\n");
+  fprintf(fd, "  -h: Display this help message.\n");
+  fprintf(fd, "\n");
+}
+
+int main(int argc, char **argv) {
+  struct gen_params params = {
+    .modes = 8,
+    .temp_ranges = 14,
+    .min_phases = 20,
+    .max_phases = 60,
+    .run_len = 8,
+    .literal_pct = 20,
+    .share_pct = 30,
+    .bpp5 = 0,
+    .seed = 1
+  };
+  struct wbf_buf buf = {NULL, 0, 0};
+  char* out_path = NULL;
+  FILE* fd;
+  int c;
+
+  while((c = getopt(argc, argv, "m:t:p:r:l:S:5s:o:h")) != -1) {
+    switch(c) {
+    case 'm':
+      params.modes = atoi(optarg);
+      break;
+    case 't':
+      params.temp_ranges = atoi(optarg);
+      break;
+    case 'p':
+      if(sscanf(optarg, "%u,%u", &params.min_phases, &params.max_phases) != 2) {
+        params.max_phases = params.min_phases;
+      }
+      break;
+    case 'r':
+      params.run_len = atoi(optarg);
+      break;
+    case 'l':
+      params.literal_pct = atoi(optarg);
+      break;
+    case 'S':
+      params.share_pct = atoi(optarg);
+      break;
+    case '5':
+      params.bpp5 = 1;
+      break;
+    case 's':
+      params.seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+
+  if(!out_path || optind != argc
+     || params.modes < 1 || params.modes > MAX_MODES
+     || params.temp_ranges < 1 || params.temp_ranges > 256
+     || params.min_phases < 1 || params.min_phases > params.max_phases
+     || params.run_len < 1 || params.run_len > 256
+     || params.literal_pct > 100 || params.share_pct > 100) {
+    usage(stderr);
+    return 1;
+  }
+
+  // xorshift must not start at 0
+  rng_state = params.seed ^ 0x9e3779b97f4a7c15ULL;
+
+  if(generate(&buf, &params) < 0) {
+    free(buf.data);
+    return 1;
+  }
+
+  fd = (strcmp(out_path, "-") == 0) ? stdout : fopen(out_path, "wb");
+  if(!fd) {
+    fprintf(stderr, "Opening file %s for writing failed: %s\n", out_path, strerror(errno));
+    free(buf.data);
+    return 1;
+  }
+  if(fwrite(buf.data, buf.len, 1, fd) != 1 || (fd != stdout && fclose(fd) != 0)) {
+    fprintf(stderr, "Error writing %s: %s\n", out_path, strerror(errno));
+    free(buf.data);
+    return 1;
+  }
+
+  free(buf.data);
+  return 0;
+}
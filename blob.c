@@ -0,0 +1,168 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// Sections follow the struct inkwave_blob at the start in the order of
+// its fields, each 8 byte aligned, then the states of every unique
+// waveform, each starting on a cache line. Everything is addressed by
+// offsets from the start so the blob can be mapped anywhere.
+
+#define BLOB_MAGIC "inkwave\0"
+
+struct blob_ctx {
+  const struct inkwave_model* model;
+  const struct inkwave_blob_waveform* waveforms;
+  char* out;
+};
+
+static uint64_t align(uint64_t pos, uint64_t to) {
+  return (pos + to - 1) & ~(to - 1);
+}
+
+// Fill in `blob` with the section offsets for the model and return
+// where the states of the first waveform go.
+static uint64_t layout(const struct inkwave_model* model, struct inkwave_blob* blob) {
+  uint64_t pos = sizeof(struct inkwave_blob);
+
+  blob->header = pos = align(pos, 8);
+  pos += sizeof(struct waveform_data_header) + model->temp_range_count + 1;
+
+  blob->temp_lut = pos = align(pos, 8);
+  pos += 256 * sizeof(uint16_t);
+
+  blob->wav_ids = pos = align(pos, 8);
+  pos += (uint64_t) model->mode_count * model->temp_range_count * sizeof(uint32_t);
+
+  blob->waveforms = pos = align(pos, 8);
+  pos += (uint64_t) model->waveform_count * sizeof(struct inkwave_blob_waveform);
+
+  return pos;
+}
+
+size_t inkwave_blob_size(const struct inkwave_model* model) {
+  struct inkwave_blob blob;
+  uint64_t pos = layout(model, &blob);
+  uint32_t i;
+
+  for(i=0; i < model->waveform_count; i++) {
+    pos = align(pos, INKWAVE_CACHE_LINE) + model->waveforms[i].state_count;
+  }
+  return pos;
+}
+
+static void decode_job(void* arg, uint32_t job) {
+  struct blob_ctx* ctx = arg;
+
+  inkwave_decode_waveform(ctx->model, &ctx->model->waveforms[job], ctx->out + ctx->waveforms[job].offset);
+}
+
+int inkwave_build_blob(struct inkwave_model* model, int threads, char* out, size_t out_size) {
+  struct inkwave_blob blob;
+  struct inkwave_blob_waveform* waveforms;
+  struct blob_ctx ctx;
+  uint64_t pos;
+  uint32_t i;
+
+  if(out_size != inkwave_blob_size(model)) {
+    return fail(model, "Output buffer is %lu bytes but the blob needs %lu bytes", (unsigned long) out_size, (unsigned long) inkwave_blob_size(model));
+  }
+
+  // padding between sections is zero too
+  memset(out, 0, out_size);
+
+  memset(&blob, 0, sizeof(blob));
+  memcpy(blob.magic, BLOB_MAGIC, sizeof(blob.magic));
+  blob.version = INKWAVE_BLOB_VERSION;
+  blob.byte_order = INKWAVE_BLOB_BYTE_ORDER;
+  blob.size = out_size;
+  blob.mode_count = model->mode_count;
+  blob.temp_range_count = model->temp_range_count;
+  blob.waveform_count = model->waveform_count;
+  blob.phase_states = inkwave_phase_states(model->header);
+  pos = layout(model, &blob);
+
+  memcpy(out + blob.header, model->header, sizeof(struct waveform_data_header));
+  memcpy(out + blob.header + sizeof(struct waveform_data_header), model->temps, model->temp_range_count + 1);
+  memcpy(out + blob.temp_lut, model->temp_lut, 256 * sizeof(uint16_t));
+  memcpy(out + blob.wav_ids, model->wav_ids, (size_t) model->mode_count * model->temp_range_count * sizeof(uint32_t));
+
+  waveforms = (struct inkwave_blob_waveform*) (out + blob.waveforms);
+  for(i=0; i < model->waveform_count; i++) {
+    pos = align(pos, INKWAVE_CACHE_LINE);
+    waveforms[i].offset = pos;
+    waveforms[i].state_count = model->waveforms[i].state_count;
+    waveforms[i].phases = model->waveforms[i].state_count / blob.phase_states;
+    pos += model->waveforms[i].state_count;
+  }
+
+  ctx.model = model;
+  ctx.waveforms = waveforms;
+  ctx.out = out;
+  run_parallel(threads, model->waveform_count, decode_job, &ctx);
+
+  // last so a reader never sees a valid header on a partial blob
+  memcpy(out, &blob, sizeof(blob));
+
+  return 0;
+}
+
+int inkwave_blob_check(const char* data, size_t size) {
+  const struct inkwave_blob* blob = (const struct inkwave_blob*) data;
+  const struct inkwave_blob_waveform* waveforms;
+  const uint32_t* wav_ids;
+  uint64_t refs_count;
+  uint64_t i;
+
+  if(size < sizeof(struct inkwave_blob)
+     || memcmp(blob->magic, BLOB_MAGIC, sizeof(blob->magic)) != 0
+     || blob->version != INKWAVE_BLOB_VERSION
+     || blob->byte_order != INKWAVE_BLOB_BYTE_ORDER
+     || blob->size != size
+     || !blob->phase_states) {
+    return -1;
+  }
+
+  refs_count = (uint64_t) blob->mode_count * blob->temp_range_count;
+  if(blob->header > size || size - blob->header < sizeof(struct waveform_data_header) + blob->temp_range_count + 1
+     || blob->temp_lut > size || size - blob->temp_lut < 256 * sizeof(uint16_t)
+     || blob->wav_ids > size || (size - blob->wav_ids) / sizeof(uint32_t) < refs_count
+     || blob->waveforms > size || (size - blob->waveforms) / sizeof(struct inkwave_blob_waveform) < blob->waveform_count
+     || (blob->temp_lut | blob->wav_ids | blob->waveforms) & 7) {
+    return -1;
+  }
+
+  wav_ids = (const uint32_t*) (data + blob->wav_ids);
+  for(i=0; i < refs_count; i++) {
+    if(wav_ids[i] >= blob->waveform_count) {
+      return -1;
+    }
+  }
+
+  waveforms = (const struct inkwave_blob_waveform*) (data + blob->waveforms);
+  for(i=0; i < blob->waveform_count; i++) {
+    if(waveforms[i].offset > size || size - waveforms[i].offset < waveforms[i].state_count) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+const char* inkwave_blob_waveform(const char* data, uint16_t mode, uint16_t temp_range, uint32_t* state_count) {
+  const struct inkwave_blob* blob = (const struct inkwave_blob*) data;
+  const struct inkwave_blob_waveform* waveform;
+  uint32_t wav;
+
+  if(mode >= blob->mode_count || temp_range >= blob->temp_range_count) {
+    return NULL;
+  }
+
+  wav = ((const uint32_t*) (data + blob->wav_ids))[mode * blob->temp_range_count + temp_range];
+  waveform = &((const struct inkwave_blob_waveform*) (data + blob->waveforms))[wav];
+  *state_count = waveform->state_count;
+  return data + waveform->offset;
+}
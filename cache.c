@@ -0,0 +1,254 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "inkwave.h"
+#include "cli.h"
+
+// The cache holds one .wrf file per distinct input named after
+// the identifying fields of the .wbf header. The header checksum
+// is a CRC-32 over the whole .wbf file so a file with the same
+// checksum, size and identity fields converts to the same .wrf
+// and only the 48 byte header needs to be read on a hit.
+
+int cache_key(const char* in_path, int flags, struct waveform_data_header* header, char* key, char* err) {
+  struct stat st;
+  ssize_t ret;
+  int fd;
+
+  fd = open(in_path, O_RDONLY);
+  if(fd < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s failed: %s", in_path, strerror(errno));
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error getting file size for %s: %s", in_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  do {
+    ret = pread(fd, header, sizeof(*header), 0);
+  } while(ret < 0 && errno == EINTR);
+  close(fd);
+
+  if(ret < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Reading file %s failed: %s", in_path, strerror(errno));
+    return -1;
+  }
+  if(ret != sizeof(*header)) {
+    snprintf(err, INKWAVE_ERR_LEN, "File too small to contain a waveform header");
+    return -1;
+  }
+
+  // catches truncated copies without reading the whole file
+  if(S_ISREG(st.st_mode) && (off_t) header->filesize != st.st_size) {
+    snprintf(err, INKWAVE_ERR_LEN, "Actual file size does not match file size reported by waveform header");
+    return -1;
+  }
+
+  // flags change the output so they are part of the key
+  snprintf(key, CACHE_KEY_LEN, "%08x-%08x-%08x-%04x-%02x%02x-%x",
+           header->checksum, header->filesize, header->serial, header->fpl_lot,
+           header->waveform_version, header->waveform_subversion, flags);
+
+  return 0;
+}
+
+static int write_all(int fd, const char* buf, size_t size, char* err) {
+  ssize_t written;
+  size_t done;
+
+  for(done=0; done < size; done += written) {
+    written = write(fd, buf + done, size - done);
+    if(written < 0) {
+      if(errno == EINTR) {
+        written = 0;
+        continue;
+      }
+      snprintf(err, INKWAVE_ERR_LEN, "Error writing output file: %s", strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// A cached file is only ever created by rename() so it is never
+// partially written, but it could still have been replaced or
+// truncated by hand. Check that it starts with the same header
+// and is large enough to hold the tables that header describes.
+static int cache_entry_valid(const char* path, const struct waveform_data_header* header) {
+  struct waveform_data_header cached;
+  struct stat st;
+  size_t min_size;
+  int fd;
+  ssize_t ret;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return 0;
+  }
+
+  do {
+    ret = pread(fd, &cached, sizeof(cached), 0);
+  } while(ret < 0 && errno == EINTR);
+  if(fstat(fd, &st) < 0) {
+    ret = -1;
+  }
+  close(fd);
+
+  if(ret != sizeof(cached) || memcmp(&cached, header, sizeof(cached)) != 0) {
+    return 0;
+  }
+
+  // header, temperatures and mode table
+  min_size = sizeof(cached) + cached.trc + 2 + 8 * (cached.mc + 1);
+
+  return S_ISREG(st.st_mode) && (size_t) st.st_size >= min_size;
+}
+
+// Copy the cached file `src` to `dst` (or to stdout if `dst` is "-").
+// Outputs get their own copy rather than a hard link so editing one
+// can never change the cache, and an existing `dst` is rewritten in
+// place so any other links to it see the new contents. Where the
+// filesystem supports it the copy is a reflink sharing the blocks.
+static int deliver(const char* src, const char* dst, char* err) {
+  struct inkwave_input input;
+  int fd;
+  int ret = -1;
+
+  if(strcmp(dst, "-") == 0) {
+    fd = STDOUT_FILENO;
+  } else {
+    fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", dst, strerror(errno));
+      return -1;
+    }
+  }
+
+#ifdef FICLONE
+  if(fd != STDOUT_FILENO) {
+    int src_fd = open(src, O_RDONLY);
+
+    if(src_fd >= 0) {
+      ret = ioctl(fd, FICLONE, src_fd);
+      close(src_fd);
+    }
+  }
+#endif
+
+  if(ret < 0) {
+    if(inkwave_input_open(&input, src) < 0) {
+      strcpy(err, input.err);
+      goto out;
+    }
+    ret = write_all(fd, input.data, input.size, err);
+    inkwave_input_close(&input);
+  }
+
+ out:
+  if(fd != STDOUT_FILENO && close(fd) < 0 && ret == 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing output file failed: %s", strerror(errno));
+    ret = -1;
+  }
+  return ret;
+}
+
+int cache_fetch(const char* cache_dir, const char* key, const struct waveform_data_header* header, const char* out_path, char* err) {
+  char path[CACHE_PATH_LEN];
+
+  snprintf(path, sizeof(path), "%s/%s.wrf", cache_dir, key);
+  if(!cache_entry_valid(path, header)) {
+    return 0;
+  }
+
+  if(deliver(path, out_path, err) < 0) {
+    return -1;
+  }
+
+  return 1;
+}
+
+int cache_begin(const char* cache_dir, const char* key, char* tmp, char* err) {
+  int fd;
+
+  if(mkdir(cache_dir, 0755) < 0 && errno != EEXIST) {
+    snprintf(err, INKWAVE_ERR_LEN, "Creating cache directory %s failed: %s", cache_dir, strerror(errno));
+    return -1;
+  }
+
+  snprintf(tmp, CACHE_PATH_LEN, "%s/.%s.XXXXXX", cache_dir, key);
+  fd = mkstemp(tmp);
+  if(fd < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Creating file in cache directory %s failed: %s", cache_dir, strerror(errno));
+    return -1;
+  }
+  close(fd);
+
+  return 0;
+}
+
+int cache_commit(const char* cache_dir, const char* key, const char* tmp, const char* out_path, char* err) {
+  char path[CACHE_PATH_LEN];
+  int fd;
+
+  fd = open(tmp, O_RDONLY);
+  if(fd < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s failed: %s", tmp, strerror(errno));
+    goto fail;
+  }
+
+  // entries are never changed, only replaced
+  if(fchmod(fd, 0444) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Making %s read-only failed: %s", tmp, strerror(errno));
+    close(fd);
+    goto fail;
+  }
+
+  // make sure the data is on disk before the name is,
+  // this is meant to survive losing power during boot
+  if(fsync(fd) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Syncing %s failed: %s", tmp, strerror(errno));
+    close(fd);
+    goto fail;
+  }
+  close(fd);
+
+  snprintf(path, sizeof(path), "%s/%s.wrf", cache_dir, key);
+  if(rename(tmp, path) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Adding %s to cache directory %s failed: %s", key, cache_dir, strerror(errno));
+    goto fail;
+  }
+
+  return deliver(path, out_path, err);
+
+ fail:
+  unlink(tmp);
+  return -1;
+}
+
+int cache_store(const char* cache_dir, const char* key, struct inkwave_model* model, int flags, int threads, const char* out_path, char* err) {
+  char tmp[CACHE_PATH_LEN];
+
+  if(cache_begin(cache_dir, key, tmp, err) < 0) {
+    return -1;
+  }
+
+  if(write_wrf(model, flags, threads, tmp, err) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return cache_commit(cache_dir, key, tmp, out_path, err);
+}
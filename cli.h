@@ -0,0 +1,86 @@
+#ifndef INKWAVE_CLI_H
+#define INKWAVE_CLI_H
+
+#include "inkwave.h"
+
+// Functions shared between the source files of the inkwave
+// command-line utility (not part of libinkwave).
+
+int write_wrf(struct inkwave_model* model, int flags, int threads, const char* path, char* err);
+
+// Convert a .wbf file read front to back from `in_path` (- for stdin)
+// keeping about `buf_size` bytes of it in memory.
+int stream_wrf(const char* in_path, size_t buf_size, int flags, const char* out_path, char* err);
+
+// Convert (or only verify if `out_template` is NULL) every .wbf file
+// named by `args`, using `cache_dir` as conversion cache if not NULL.
+// Returns the number of files that failed.
+int run_batch(char** args, int arg_count, const char* out_template, const char* cache_dir, int flags, int threads);
+
+// Header-only inventory of every .wbf file named by `args` (same as
+// run_batch()): one CSV or JSON line per file on stdout describing its
+// header and xwia. The rest of a file is only read if `check_crc` is set.
+// Returns the number of files that failed.
+#define SCAN_CSV  (1)
+#define SCAN_JSON (2)
+int run_scan(char** args, int arg_count, int format, int check_crc, int threads);
+
+// Load and decode the waveform file at `in_path` and answer requests
+// on a Unix socket at `socket_path` until SIGINT or SIGTERM, reloading
+// the file when it changes. Returns 0 on a clean exit or -1 with a
+// message in `err` if the file couldn't be loaded or the socket set up.
+int run_serve(const char* in_path, int is_wbf, const char* socket_path, char* err);
+
+// Print what differs between two waveform files: header fields, the
+// temperature ranges and the waveform of each (mode, temperature range).
+// Returns 0 if nothing does, 1 if something does or -1 on failure with
+// a message in `err`.
+int run_diff(const char* old_path, int old_is_wbf, const char* new_path, int new_is_wbf, char* err);
+
+// Descriptions of header field values (see main.c)
+
+typedef struct {
+  uint32_t key;
+  const char* val;
+} Pair;
+
+extern Pair mfg_codes[];
+extern Pair run_types[];
+extern Pair fpl_platforms[];
+extern Pair fpl_sizes[];
+extern Pair fpl_rates[];
+extern Pair mode_versions[];
+extern Pair waveform_types[];
+extern Pair waveform_tuning_biases[];
+
+// `def` (or "Unknown" if NULL) if there is no description for `key`
+const char* get_desc(Pair table[], unsigned int key, const char* def);
+const char* get_desc_mfg_code(unsigned int mfg_code);
+
+// Conversion cache (see cache.c)
+
+#define CACHE_KEY_LEN (64)
+#define CACHE_PATH_LEN (4096)
+
+// Read only the header of `in_path` into `header` and derive
+// the cache key for converting it with `flags` into `key`
+// which must have room for CACHE_KEY_LEN bytes.
+int cache_key(const char* in_path, int flags, struct waveform_data_header* header, char* key, char* err);
+
+// Link or copy the cached .wrf file for `key` to `out_path`.
+// Returns 1 on a hit, 0 on a miss (nothing is written)
+// or -1 on failure with a message in `err`.
+int cache_fetch(const char* cache_dir, const char* key, const struct waveform_data_header* header, const char* out_path, char* err);
+
+// Create an empty temporary file in the cache directory and put
+// its name in `tmp` (CACHE_PATH_LEN bytes). Once the .wrf has been
+// written to it cache_commit() moves it into place and links or
+// copies it to `out_path`. On failure the temporary file is removed.
+int cache_begin(const char* cache_dir, const char* key, char* tmp, char* err);
+int cache_commit(const char* cache_dir, const char* key, const char* tmp, const char* out_path, char* err);
+
+// Generate the .wrf file into the cache, atomically, and
+// then link or copy it to `out_path`.
+int cache_store(const char* cache_dir, const char* key, struct inkwave_model* model, int flags, int threads, const char* out_path, char* err);
+
+#endif
@@ -0,0 +1,238 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CLMUL_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_PMULL
+#endif
+
+#include "inkwave.h"
+#include "crc32_table.h"
+
+// All functions below work on the internal CRC state,
+// that is the CRC value with all bits inverted.
+
+static uint32_t crc32_bytes(uint32_t c, const unsigned char* buf, size_t len) {
+  while(len--) {
+    c = crc32_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+  }
+  return c;
+}
+
+// portable slicing-by-8
+// (the .wbf format is little-endian and so is this)
+static uint32_t crc32_slice8(uint32_t c, const unsigned char* buf, size_t len) {
+  uint32_t one;
+  uint32_t two;
+
+  while(len >= 8) {
+    memcpy(&one, buf, 4);
+    memcpy(&two, buf + 4, 4);
+    one ^= c;
+
+    c = crc32_table[7][one & 0xff]
+      ^ crc32_table[6][(one >> 8) & 0xff]
+      ^ crc32_table[5][(one >> 16) & 0xff]
+      ^ crc32_table[4][one >> 24]
+      ^ crc32_table[3][two & 0xff]
+      ^ crc32_table[2][(two >> 8) & 0xff]
+      ^ crc32_table[1][(two >> 16) & 0xff]
+      ^ crc32_table[0][two >> 24];
+
+    buf += 8;
+    len -= 8;
+  }
+
+  return crc32_bytes(c, buf, len);
+}
+
+// Folding constants for carry-less multiplication,
+// see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+// by Gopal et al. (Intel, 2009). These are the bit-reflected
+// constants for polynomial 0x04c11db7.
+#define CRC32_K1 (0x154442bd4ULL) // x^(4*128+32) mod P
+#define CRC32_K2 (0x1c6e41596ULL) // x^(4*128-32) mod P
+#define CRC32_K3 (0x1751997d0ULL) // x^(128+32) mod P
+#define CRC32_K4 (0x0ccaa009eULL) // x^(128-32) mod P
+#define CRC32_K5 (0x163cd6124ULL) // x^64 mod P
+#define CRC32_P  (0x1db710641ULL) // P
+#define CRC32_MU (0x1f7011641ULL) // floor(x^64 / P)
+
+#ifdef HAVE_CLMUL_X86
+
+// fold 128 bits of state into the next 128 bits of data
+#define FOLD_X86(x, k, next) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((x), (k), 0x00), \
+                              _mm_clmulepi64_si128((x), (k), 0x11)), (next))
+
+// `len` must be at least 64 and a multiple of 16
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(uint32_t c, const unsigned char* buf, size_t len) {
+  __m128i x1, x2, x3, x4, k;
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, 0, 0);
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) buf), _mm_cvtsi32_si128(c));
+  x2 = _mm_loadu_si128((const __m128i*) (buf + 16));
+  x3 = _mm_loadu_si128((const __m128i*) (buf + 32));
+  x4 = _mm_loadu_si128((const __m128i*) (buf + 48));
+  buf += 64;
+  len -= 64;
+
+  // fold 512 bits at a time
+  k = _mm_set_epi64x(CRC32_K2, CRC32_K1);
+  while(len >= 64) {
+    x1 = FOLD_X86(x1, k, _mm_loadu_si128((const __m128i*) buf));
+    x2 = FOLD_X86(x2, k, _mm_loadu_si128((const __m128i*) (buf + 16)));
+    x3 = FOLD_X86(x3, k, _mm_loadu_si128((const __m128i*) (buf + 32)));
+    x4 = FOLD_X86(x4, k, _mm_loadu_si128((const __m128i*) (buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  // fold down to 128 bits
+  k = _mm_set_epi64x(CRC32_K4, CRC32_K3);
+  x1 = FOLD_X86(x1, k, x2);
+  x1 = FOLD_X86(x1, k, x3);
+  x1 = FOLD_X86(x1, k, x4);
+
+  while(len >= 16) {
+    x1 = FOLD_X86(x1, k, _mm_loadu_si128((const __m128i*) buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  // 128 to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  // 64 to 32 bits
+  k = _mm_set_epi64x(0, CRC32_K5);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction
+  k = _mm_set_epi64x(CRC32_MU, CRC32_P);
+  x2 = x1;
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return _mm_extract_epi32(x1, 1);
+}
+
+static int have_clmul() {
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#endif
+
+#ifdef HAVE_PMULL
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t clmul_lo(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0), (poly64_t) vgetq_lane_u64(b, 0)));
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t clmul_hi(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 1), (poly64_t) vgetq_lane_u64(b, 1)));
+}
+
+// low half of `a` times high half of `b`
+__attribute__((target("+crypto")))
+static inline uint64x2_t clmul_lo_hi(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t) vgetq_lane_u64(a, 0), (poly64_t) vgetq_lane_u64(b, 1)));
+}
+
+static inline uint64x2_t load128(const unsigned char* buf) {
+  return vreinterpretq_u64_u8(vld1q_u8(buf));
+}
+
+#define FOLD_ARM(x, k, next) \
+  veorq_u64(veorq_u64(clmul_lo((x), (k)), clmul_hi((x), (k))), (next))
+
+// `len` must be at least 64 and a multiple of 16
+__attribute__((target("+crypto")))
+static uint32_t crc32_clmul(uint32_t c, const unsigned char* buf, size_t len) {
+  uint64x2_t x1, x2, x3, x4, k;
+  const uint64x2_t mask32 = vcombine_u64(vcreate_u64(0xffffffff), vcreate_u64(0));
+
+  x1 = veorq_u64(load128(buf), vcombine_u64(vcreate_u64(c), vcreate_u64(0)));
+  x2 = load128(buf + 16);
+  x3 = load128(buf + 32);
+  x4 = load128(buf + 48);
+  buf += 64;
+  len -= 64;
+
+  // fold 512 bits at a time
+  k = vcombine_u64(vcreate_u64(CRC32_K1), vcreate_u64(CRC32_K2));
+  while(len >= 64) {
+    x1 = FOLD_ARM(x1, k, load128(buf));
+    x2 = FOLD_ARM(x2, k, load128(buf + 16));
+    x3 = FOLD_ARM(x3, k, load128(buf + 32));
+    x4 = FOLD_ARM(x4, k, load128(buf + 48));
+    buf += 64;
+    len -= 64;
+  }
+
+  // fold down to 128 bits
+  k = vcombine_u64(vcreate_u64(CRC32_K3), vcreate_u64(CRC32_K4));
+  x1 = FOLD_ARM(x1, k, x2);
+  x1 = FOLD_ARM(x1, k, x3);
+  x1 = FOLD_ARM(x1, k, x4);
+
+  while(len >= 16) {
+    x1 = FOLD_ARM(x1, k, load128(buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  // 128 to 64 bits
+  x2 = clmul_lo_hi(x1, k);
+  x1 = veorq_u64(vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x1), vdupq_n_u8(0), 8)), x2);
+
+  // 64 to 32 bits
+  k = vcombine_u64(vcreate_u64(CRC32_K5), vcreate_u64(0));
+  x2 = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x1), vdupq_n_u8(0), 4));
+  x1 = clmul_lo(vandq_u64(x1, mask32), k);
+  x1 = veorq_u64(x1, x2);
+
+  // Barrett reduction
+  k = vcombine_u64(vcreate_u64(CRC32_P), vcreate_u64(CRC32_MU));
+  x2 = x1;
+  x1 = clmul_lo_hi(vandq_u64(x1, mask32), k);
+  x1 = clmul_lo(vandq_u64(x1, mask32), k);
+  x1 = veorq_u64(x1, x2);
+
+  return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+static int have_clmul() {
+  return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+
+#endif
+
+uint32_t inkwave_crc32(uint32_t crc, const char* buf, size_t len) {
+  const unsigned char* p = (const unsigned char*) buf;
+  uint32_t c = crc ^ 0xffffffff;
+#if defined(HAVE_CLMUL_X86) || defined(HAVE_PMULL)
+  size_t n;
+
+  if(len >= 64 && have_clmul()) {
+    n = len & ~((size_t) 15);
+    c = crc32_clmul(c, p, n);
+    p += n;
+    len -= n;
+  }
+#endif
+
+  return crc32_slice8(c, p, len) ^ 0xffffffff;
+}
@@ -0,0 +1,252 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_DECODE_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_DECODE_NEON
+#endif
+
+#include "inkwave.h"
+#include "internal.h"
+
+// Each packed byte holds four 2-bit states, lowest bits first.
+// Unpacked every state gets its own byte, so on a little-endian
+// machine a packed byte b unpacks to this 32 bit value.
+#define UNPACK(b) ((uint32_t) ((b) & 3) \
+                   | ((uint32_t) (((b) >> 2) & 3) << 8) \
+                   | ((uint32_t) (((b) >> 4) & 3) << 16) \
+                   | ((uint32_t) (((b) >> 6) & 3) << 24))
+
+#define UNPACK4(b) UNPACK(b), UNPACK(b + 1), UNPACK(b + 2), UNPACK(b + 3)
+#define UNPACK16(b) UNPACK4(b), UNPACK4(b + 4), UNPACK4(b + 8), UNPACK4(b + 12)
+#define UNPACK64(b) UNPACK16(b), UNPACK16(b + 16), UNPACK16(b + 32), UNPACK16(b + 48)
+
+static const uint32_t unpack_table[256] = {
+  UNPACK64(0), UNPACK64(64), UNPACK64(128), UNPACK64(192)
+};
+
+// number of bytes before the next 0xfc tag
+static inline uint32_t literal_span(const char* p, uint32_t max) {
+  const char* end = memchr(p, 0xfc, max);
+
+  return (end) ? end - p : max;
+}
+
+static inline void fill_scalar(char* out, uint32_t u, uint32_t count) {
+  while(count--) {
+    memcpy(out, &u, sizeof(u));
+    out += sizeof(u);
+  }
+}
+
+static inline void unpack_scalar(char* out, const char* in, uint32_t n) {
+  while(n--) {
+    memcpy(out, &unpack_table[(uint8_t) *in++], sizeof(uint32_t));
+    out += sizeof(uint32_t);
+  }
+}
+
+// The decoder loop is the same for every instruction set,
+// only the way runs are stored and literal sections are
+// unpacked differs. `len - 1` is used as the end since the
+// last byte can never start a complete (pattern, count) pair.
+#define DEFINE_DECODER(name, fill, unpack) \
+  static char* name(const char* waveform, uint32_t len, char* out) { \
+    uint32_t i = 0; \
+    uint32_t n; \
+    uint32_t count; \
+    int fc_active = 0; \
+    \
+    while(i < len - 1) { \
+      if((uint8_t) waveform[i] == 0xfc) { \
+        fc_active = !fc_active; \
+        i++; \
+        continue; \
+      } \
+      \
+      if(fc_active) { \
+        n = literal_span(waveform + i, len - 1 - i); \
+        unpack(out, waveform + i, n); \
+        out += 4 * n; \
+        i += n; \
+      } else { \
+        count = (uint8_t) waveform[i + 1] + 1; \
+        fill(out, unpack_table[(uint8_t) waveform[i]], count); \
+        out += 4 * count; \
+        i += 2; \
+      } \
+    } \
+    return out; \
+  }
+
+DEFINE_DECODER(decode_scalar, fill_scalar, unpack_scalar)
+
+#ifdef HAVE_DECODE_X86
+
+static inline void fill_sse2(char* out, uint32_t u, uint32_t count) {
+  __m128i v = _mm_set1_epi32(u);
+
+  for(; count >= 4; count -= 4) {
+    _mm_storeu_si128((__m128i*) out, v);
+    out += 16;
+  }
+  fill_scalar(out, u, count);
+}
+
+// widen 4 (SSE) or 8 (AVX2) packed bytes to one per 32 bit lane
+// and then move the 2-bit states into their own byte
+#define UNPACK_LANES(x, and, or, sll, set1) \
+  or(or(and(x, set1(0x03)), sll(and(x, set1(0x0c)), 6)), \
+     or(sll(and(x, set1(0x30)), 12), sll(and(x, set1(0xc0)), 18)))
+
+__attribute__((target("sse4.1")))
+static inline void unpack_sse41(char* out, const char* in, uint32_t n) {
+  int32_t b;
+  __m128i x;
+
+  for(; n >= 4; n -= 4) {
+    memcpy(&b, in, sizeof(b));
+    x = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(b));
+    x = UNPACK_LANES(x, _mm_and_si128, _mm_or_si128, _mm_slli_epi32, _mm_set1_epi32);
+    _mm_storeu_si128((__m128i*) out, x);
+    in += 4;
+    out += 16;
+  }
+  unpack_scalar(out, in, n);
+}
+
+__attribute__((target("avx2")))
+static inline void fill_avx2(char* out, uint32_t u, uint32_t count) {
+  __m256i v = _mm256_set1_epi32(u);
+
+  for(; count >= 8; count -= 8) {
+    _mm256_storeu_si256((__m256i*) out, v);
+    out += 32;
+  }
+  if(count >= 4) {
+    _mm_storeu_si128((__m128i*) out, _mm256_castsi256_si128(v));
+    out += 16;
+    count -= 4;
+  }
+  fill_scalar(out, u, count);
+}
+
+__attribute__((target("avx2")))
+static inline void unpack_avx2(char* out, const char* in, uint32_t n) {
+  __m256i x;
+
+  for(; n >= 8; n -= 8) {
+    x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) in));
+    x = UNPACK_LANES(x, _mm256_and_si256, _mm256_or_si256, _mm256_slli_epi32, _mm256_set1_epi32);
+    _mm256_storeu_si256((__m256i*) out, x);
+    in += 8;
+    out += 32;
+  }
+  unpack_sse41(out, in, n);
+}
+
+__attribute__((target("sse4.1")))
+DEFINE_DECODER(decode_sse41, fill_sse2, unpack_sse41)
+
+__attribute__((target("avx2")))
+DEFINE_DECODER(decode_avx2, fill_avx2, unpack_avx2)
+
+#endif
+
+#ifdef HAVE_DECODE_NEON
+
+static inline void fill_neon(char* out, uint32_t u, uint32_t count) {
+  uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(u));
+
+  for(; count >= 4; count -= 4) {
+    vst1q_u8((uint8_t*) out, v);
+    out += 16;
+  }
+  fill_scalar(out, u, count);
+}
+
+static inline void unpack_neon(char* out, const char* in, uint32_t n) {
+  // copy each packed byte into four lanes, shift each lane
+  // right by 0, 2, 4 or 6 bits and keep the low two bits
+  static const uint8_t spread_lo[16] = {0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3};
+  static const uint8_t spread_hi[16] = {4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7};
+  static const int8_t shifts[16] = {0, -2, -4, -6, 0, -2, -4, -6, 0, -2, -4, -6, 0, -2, -4, -6};
+  const uint8x16_t idx_lo = vld1q_u8(spread_lo);
+  const uint8x16_t idx_hi = vld1q_u8(spread_hi);
+  const int8x16_t shift = vld1q_s8(shifts);
+  const uint8x16_t mask = vdupq_n_u8(3);
+  uint8x16_t x;
+
+  for(; n >= 8; n -= 8) {
+    x = vcombine_u8(vld1_u8((const uint8_t*) in), vdup_n_u8(0));
+    vst1q_u8((uint8_t*) out, vandq_u8(vshlq_u8(vqtbl1q_u8(x, idx_lo), shift), mask));
+    vst1q_u8((uint8_t*) out + 16, vandq_u8(vshlq_u8(vqtbl1q_u8(x, idx_hi), shift), mask));
+    in += 8;
+    out += 32;
+  }
+  unpack_scalar(out, in, n);
+}
+
+DEFINE_DECODER(decode_neon, fill_neon, unpack_neon)
+
+#endif
+
+long decode_waveform(const char* waveform, uint32_t len, char* out) {
+  char* end;
+
+  if(len < 2) {
+    return 0;
+  }
+
+#if defined(HAVE_DECODE_X86)
+  if(__builtin_cpu_supports("avx2")) {
+    end = decode_avx2(waveform, len, out);
+  } else if(__builtin_cpu_supports("sse4.1")) {
+    end = decode_sse41(waveform, len, out);
+  } else {
+    end = decode_scalar(waveform, len, out);
+  }
+#elif defined(HAVE_DECODE_NEON)
+  end = decode_neon(waveform, len, out);
+#else
+  end = decode_scalar(waveform, len, out);
+#endif
+
+  return end - out;
+}
+
+long count_waveform_states(const char* waveform, uint32_t len) {
+  uint32_t i = 0;
+  uint32_t n;
+  long state_count = 0;
+  int fc_active = 0;
+
+  if(len < 2) {
+    return 0;
+  }
+
+  while(i < len - 1) {
+    // 0xfc is a start and end tag for a section
+    // of one-byte bit-patterns with an assumed count of 1
+    if((uint8_t) waveform[i] == 0xfc) {
+      fc_active = !fc_active;
+      i++;
+      continue;
+    }
+
+    if(fc_active) { // 1-byte patterns (count is always 1)
+      n = literal_span(waveform + i, len - 1 - i);
+      state_count += 4 * n;
+      i += n;
+    } else { // 2-byte pattern (second byte is count)
+      state_count += 4 * ((uint8_t) waveform[i + 1] + 1);
+      i += 2;
+    }
+  }
+
+  return state_count;
+}
@@ -0,0 +1,268 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "cli.h"
+
+// Each unique waveform of both files is hashed as stored, without
+// decoding. (mode, temperature range) pairs are matched by index and
+// only pairs whose hashes differ are decoded and compared state by
+// state, since the same states can be encoded differently. A pair of
+// waveforms shared by many (mode, temperature range) is compared once.
+
+#define NO_WAV (UINT32_MAX)
+
+struct diff_file {
+  struct inkwave_input input;
+  char* arena_buf;
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+  uint32_t* hashes; // of each unique waveform
+  char* states; // room for the largest waveform
+};
+
+// result of comparing waveform `wav` of the old file with `other`
+struct diff_memo {
+  uint32_t other;
+  uint32_t phases; // that differ, 0 if the states are the same
+};
+
+// header fields in the order they are stored
+#define HEADER_FIELDS(X) \
+  X(checksum) X(filesize) X(serial) X(run_type) X(fpl_platform) X(fpl_lot) \
+  X(mode_version_or_adhesive_run_num) X(waveform_version) X(waveform_subversion) \
+  X(waveform_type) X(fpl_size) X(mfg_code) X(waveform_tuning_bias_or_rev) X(fpl_rate) \
+  X(unknown0) X(vcom_shifted) X(unknown1) X(xwia) X(cs1) X(wmta) X(fvsn) X(luts) \
+  X(mc) X(trc) X(advanced_wfm_flags) X(eb) X(sb) X(reserved0_1) X(reserved0_2) \
+  X(reserved0_3) X(reserved0_4) X(reserved0_5) X(cs2)
+
+static int open_file(struct diff_file* file, const char* path, int is_wbf, char* err) {
+  size_t arena_size;
+  uint32_t max_states = 0;
+  uint32_t i;
+  int ret;
+
+  if(inkwave_input_open(&file->input, path) < 0) {
+    strcpy(err, file->input.err);
+    return -1;
+  }
+
+  if(file->input.size < sizeof(struct waveform_data_header)) {
+    snprintf(err, INKWAVE_ERR_LEN, "%s: File too small to contain a waveform header", path);
+    return -1;
+  }
+
+  arena_size = inkwave_arena_size((const struct waveform_data_header*) file->input.data);
+  file->arena_buf = malloc(arena_size);
+  if(!file->arena_buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    return -1;
+  }
+  inkwave_arena_init(&file->arena, file->arena_buf, arena_size);
+
+  if(is_wbf) {
+    ret = inkwave_parse_wbf(&file->model, &file->arena, file->input.data, file->input.size);
+  } else {
+    ret = inkwave_parse_wrf(&file->model, &file->arena, file->input.data, file->input.size);
+  }
+  if(ret < 0) {
+    // the message alone can fill `err`, so the path goes out first
+    fprintf(stderr, "%s: ", path);
+    strcpy(err, file->model.err);
+    return -1;
+  }
+
+  file->hashes = malloc(file->model.waveform_count * sizeof(uint32_t) + 1);
+  if(!file->hashes) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    return -1;
+  }
+  for(i=0; i < file->model.waveform_count; i++) {
+    file->hashes[i] = inkwave_waveform_hash(&file->model, &file->model.waveforms[i]);
+    if(file->model.waveforms[i].state_count > max_states) {
+      max_states = file->model.waveforms[i].state_count;
+    }
+  }
+
+  file->states = malloc(max_states + 1);
+  if(!file->states) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void close_file(struct diff_file* file) {
+  free(file->states);
+  free(file->hashes);
+  free(file->arena_buf);
+  inkwave_input_close(&file->input);
+}
+
+static uint32_t diff_header(const struct waveform_data_header* a, const struct waveform_data_header* b) {
+  uint32_t count = 0;
+
+#define DIFF_FIELD(name) \
+  if(a->name != b->name) { \
+    printf("header %s: 0x%x -> 0x%x\n", #name, (unsigned int) a->name, (unsigned int) b->name); \
+    count++; \
+  }
+  HEADER_FIELDS(DIFF_FIELD)
+#undef DIFF_FIELD
+
+  return count;
+}
+
+static uint32_t diff_temps(const struct inkwave_model* a, const struct inkwave_model* b) {
+  uint16_t i;
+
+  if(a->temp_range_count == b->temp_range_count
+     && memcmp(a->temps, b->temps, a->temp_range_count + 1) == 0) {
+    return 0;
+  }
+
+  printf("temperature ranges:");
+  for(i=0; i <= a->temp_range_count; i++) {
+    printf(" %u", a->temps[i]);
+  }
+  printf(" ->");
+  for(i=0; i <= b->temp_range_count; i++) {
+    printf(" %u", b->temps[i]);
+  }
+  printf("\n");
+
+  return 1;
+}
+
+// Number of phases in which waveform `wa` of `a` and `wb` of `b`
+// differ, 0 if their states are the same.
+static uint32_t compare_waveforms(struct diff_file* a, uint32_t wa, struct diff_file* b, uint32_t wb) {
+  const struct inkwave_waveform* waveform_a = &a->model.waveforms[wa];
+  const struct inkwave_waveform* waveform_b = &b->model.waveforms[wb];
+  uint32_t phase_states = inkwave_phase_states(a->model.header);
+  uint32_t phases = 0;
+  uint32_t i, len;
+
+  // the same encoding can only mean the same states
+  if(a->model.is_wrf == b->model.is_wrf && a->hashes[wa] == b->hashes[wb]
+     && waveform_a->state_count == waveform_b->state_count) {
+    return 0;
+  }
+
+  // different lengths count as every phase changed
+  if(waveform_a->state_count != waveform_b->state_count || phase_states != inkwave_phase_states(b->model.header)) {
+    phases = waveform_a->state_count / phase_states;
+    i = waveform_b->state_count / inkwave_phase_states(b->model.header);
+    return (phases > i) ? phases : i;
+  }
+
+  inkwave_decode_waveform(&a->model, waveform_a, a->states);
+  inkwave_decode_waveform(&b->model, waveform_b, b->states);
+
+  // the last phase may be cut short
+  for(i=0; i < waveform_a->state_count; i += phase_states) {
+    len = (waveform_a->state_count - i < phase_states) ? waveform_a->state_count - i : phase_states;
+    if(memcmp(a->states + i, b->states + i, len) != 0) {
+      phases++;
+    }
+  }
+
+  return phases;
+}
+
+int run_diff(const char* old_path, int old_is_wbf, const char* new_path, int new_is_wbf, char* err) {
+  struct diff_file a, b;
+  struct inkwave_model* ma = &a.model;
+  struct inkwave_model* mb = &b.model;
+  struct diff_memo* memo = NULL;
+  uint32_t changed = 0, added = 0, removed = 0, same = 0, reencoded = 0;
+  uint32_t differences;
+  uint32_t wa, wb, phases;
+  uint16_t mode_count, temp_range_count;
+  uint16_t m, t;
+  int ret = -1;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+
+  if(open_file(&a, old_path, old_is_wbf, err) < 0 || open_file(&b, new_path, new_is_wbf, err) < 0) {
+    goto out;
+  }
+
+  memo = malloc(ma->waveform_count * sizeof(struct diff_memo) + 1);
+  if(!memo) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  for(wa=0; wa < ma->waveform_count; wa++) {
+    memo[wa].other = NO_WAV;
+  }
+
+  differences = diff_header(ma->header, mb->header);
+  differences += diff_temps(ma, mb);
+
+  mode_count = (ma->mode_count > mb->mode_count) ? ma->mode_count : mb->mode_count;
+  temp_range_count = (ma->temp_range_count > mb->temp_range_count) ? ma->temp_range_count : mb->temp_range_count;
+
+  for(m=0; m < mode_count; m++) {
+    if(m >= ma->mode_count || m >= mb->mode_count) {
+      printf("mode %u: %s\n", m, (m >= ma->mode_count) ? "added" : "removed");
+      if(m >= ma->mode_count) {
+        added += mb->temp_range_count;
+      } else {
+        removed += ma->temp_range_count;
+      }
+      continue;
+    }
+
+    for(t=0; t < temp_range_count; t++) {
+      if(t >= ma->temp_range_count) {
+        printf("mode %u range %u: added\n", m, t);
+        added++;
+        continue;
+      }
+      if(t >= mb->temp_range_count) {
+        printf("mode %u range %u: removed\n", m, t);
+        removed++;
+        continue;
+      }
+
+      wa = ma->wav_ids[m * ma->temp_range_count + t];
+      wb = mb->wav_ids[m * mb->temp_range_count + t];
+      if(memo[wa].other != wb) {
+        memo[wa].other = wb;
+        memo[wa].phases = compare_waveforms(&a, wa, &b, wb);
+      }
+      phases = memo[wa].phases;
+
+      if(phases) {
+        printf("mode %u range %u: changed, %u -> %u phases, %u differ\n", m, t,
+               ma->waveforms[wa].state_count / inkwave_phase_states(ma->header),
+               mb->waveforms[wb].state_count / inkwave_phase_states(mb->header), phases);
+        changed++;
+      } else {
+        same++;
+        if(ma->is_wrf != mb->is_wrf || a.hashes[wa] != b.hashes[wb]) {
+          reencoded++;
+        }
+      }
+    }
+  }
+
+  printf("%u changed, %u added, %u removed, %u unchanged (%u encoded differently)\n",
+         changed, added, removed, same, reencoded);
+
+  differences += changed + added + removed;
+  ret = (differences) ? 1 : 0;
+
+ out:
+  free(memo);
+  close_file(&a);
+  close_file(&b);
+  return ret;
+}
@@ -0,0 +1,341 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// The .wbf run-length encoding has two modes. Outside of a literal
+// section every packed byte comes as a (pattern, count - 1) pair of up
+// to 256 repeats, inside one every byte stands for itself. 0xfc switches
+// between them, so a packed byte of 0xfc can't be stored in either.
+//
+// The smallest encoding is found backwards over the packed bytes with
+// two costs per position: the rest encoded starting in pair mode and
+// starting in a literal section. Taking the longest possible run is
+// always best in pair mode since the cost of the rest never grows as
+// it gets shorter. The output has to end in pair mode because the
+// decoder never looks at the last byte before the trailing two.
+
+#define WBF_MAX_ADDR (0xffffff)
+
+// bytes after each encoded waveform, see README.md
+#define WBF_TRAILER (2)
+
+// scratch for encoding the largest waveform of the model
+struct encoder {
+  char* states;
+  uint8_t* packed;
+  uint32_t* pair_cost;
+  uint32_t* literal_cost;
+  uint32_t* wav_addrs; // output address of each model waveform, 0 until written
+  uint32_t* out_addrs; // address and length of each distinct waveform written
+  uint32_t* out_lens;
+  uint32_t out_count;
+  uint32_t* hashes; // open addressing table of out_addrs indices + 1
+  uint32_t hash_mask;
+};
+
+static uint32_t max_packed(const struct inkwave_model* model) {
+  uint32_t max = 0;
+  uint32_t i;
+
+  for(i=0; i < model->waveform_count; i++) {
+    if(model->waveforms[i].state_count > max) {
+      max = model->waveforms[i].state_count;
+    }
+  }
+  return (max + 3) / 4;
+}
+
+static uint32_t hash_slots(const struct inkwave_model* model) {
+  uint32_t slots = 1;
+
+  while(slots < 2 * model->waveform_count) {
+    slots <<= 1;
+  }
+  return slots;
+}
+
+size_t inkwave_wbf_arena_size(const struct inkwave_model* model) {
+  size_t packed = max_packed(model);
+
+  // + 8 per allocation for alignment
+  return (4 * packed + 8) + (packed + 8)
+    + 2 * ((packed + 1) * sizeof(uint32_t) + 8)
+    + 3 * (model->waveform_count * sizeof(uint32_t) + 8)
+    + (hash_slots(model) * sizeof(uint32_t) + 8);
+}
+
+size_t inkwave_wbf_max_size(const struct inkwave_model* model) {
+  size_t size;
+  uint32_t i;
+
+  size = sizeof(struct waveform_data_header) + model->temp_range_count + 2;
+  size += 1 + model->xwia_len + 1;
+  size += 4 * model->mode_count;
+  size += 4 * model->mode_count * model->temp_range_count;
+
+  // one long literal section is never beaten by anything worse
+  for(i=0; i < model->waveform_count; i++) {
+    size += (model->waveforms[i].state_count + 3) / 4 + 2 + WBF_TRAILER;
+  }
+  return size;
+}
+
+static int init_encoder(struct inkwave_model* model, struct inkwave_arena* arena, struct encoder* enc) {
+  uint32_t packed = max_packed(model);
+  uint32_t slots = hash_slots(model);
+
+  enc->hash_mask = slots - 1;
+  enc->out_count = 0;
+  enc->states = inkwave_arena_alloc(arena, 4 * (size_t) packed);
+  enc->packed = inkwave_arena_alloc(arena, packed);
+  enc->pair_cost = inkwave_arena_alloc(arena, (packed + 1) * sizeof(uint32_t));
+  enc->literal_cost = inkwave_arena_alloc(arena, (packed + 1) * sizeof(uint32_t));
+  enc->wav_addrs = inkwave_arena_alloc(arena, model->waveform_count * sizeof(uint32_t));
+  enc->out_addrs = inkwave_arena_alloc(arena, model->waveform_count * sizeof(uint32_t));
+  enc->out_lens = inkwave_arena_alloc(arena, model->waveform_count * sizeof(uint32_t));
+  enc->hashes = inkwave_arena_alloc(arena, slots * sizeof(uint32_t));
+  if(!enc->states || !enc->packed || !enc->pair_cost || !enc->literal_cost
+     || !enc->wav_addrs || !enc->out_addrs || !enc->out_lens || !enc->hashes) {
+    return fail(model, "Arena too small");
+  }
+
+  memset(enc->wav_addrs, 0, model->waveform_count * sizeof(uint32_t));
+  memset(enc->hashes, 0, slots * sizeof(uint32_t));
+  return 0;
+}
+
+// bytes in the run of identical packed bytes starting at `i`, up to 256
+static inline uint32_t run_length(const uint8_t* packed, uint32_t i, uint32_t n) {
+  uint32_t end = (n - i > 256) ? i + 256 : n;
+  uint32_t j = i + 1;
+
+  while(j < end && packed[j] == packed[i]) {
+    j++;
+  }
+  return j - i;
+}
+
+// Encode `n` packed bytes at `out`, which must have room for n + 2
+// bytes. Returns the number of bytes written.
+static uint32_t encode_packed(struct encoder* enc, uint32_t n, uint8_t* out) {
+  const uint8_t* packed = enc->packed;
+  uint32_t* pair = enc->pair_cost;
+  uint32_t* literal = enc->literal_cost;
+  uint32_t i, run, cost, len = 0;
+  int in_literal = 0;
+
+  pair[n] = 0;
+  literal[n] = 1; // closing 0xfc
+  for(i=n; i-- > 0;) {
+    run = run_length(packed, i, n);
+    cost = 2 + pair[i + run];
+    // open a section here, switching back right away never pays off
+    if(packed[i] != 0xfc && 2 + literal[i + 1] < cost) {
+      cost = 2 + literal[i + 1];
+    }
+    pair[i] = cost;
+
+    literal[i] = 1 + pair[i];
+    if(packed[i] != 0xfc && 1 + literal[i + 1] < literal[i]) {
+      literal[i] = 1 + literal[i + 1];
+    }
+  }
+
+  // walk forward following the choices made above
+  for(i=0; i < n;) {
+    if(in_literal) {
+      if(packed[i] != 0xfc && literal[i] == 1 + literal[i + 1]) {
+        out[len++] = packed[i++];
+        continue;
+      }
+      out[len++] = 0xfc;
+      in_literal = 0;
+      continue;
+    }
+
+    run = run_length(packed, i, n);
+    if(pair[i] == 2 + pair[i + run]) {
+      out[len++] = packed[i];
+      out[len++] = run - 1;
+      i += run;
+      continue;
+    }
+    out[len++] = 0xfc;
+    in_literal = 1;
+  }
+  if(in_literal) {
+    out[len++] = 0xfc;
+  }
+
+  return len;
+}
+
+// Pack the states of waveform `wav` four to a byte, lowest bits first,
+// padding a partial last byte with 0 states. Returns the packed length.
+static long pack_waveform(struct inkwave_model* model, struct encoder* enc, uint32_t wav) {
+  const struct inkwave_waveform* waveform = &model->waveforms[wav];
+  uint32_t n = (waveform->state_count + 3) / 4;
+  const uint8_t* s = (const uint8_t*) enc->states;
+  uint32_t i;
+
+  memset(enc->states + waveform->state_count, 0, 4 * n - waveform->state_count);
+  inkwave_decode_waveform(model, waveform, enc->states);
+
+  for(i=0; i < n; i++) {
+    if(s[4 * i] > 3 || s[4 * i + 1] > 3 || s[4 * i + 2] > 3 || s[4 * i + 3] > 3) {
+      return fail(model, "Waveform %u has a state larger than 3", wav);
+    }
+    enc->packed[i] = s[4 * i] | s[4 * i + 1] << 2 | s[4 * i + 2] << 4 | s[4 * i + 3] << 6;
+    if(enc->packed[i] == 0xfc) {
+      return fail(model, "Waveform %u contains the packed byte 0xfc which a .wbf can't store", wav);
+    }
+  }
+  return n;
+}
+
+// 24 bit address followed by the sum of its bytes
+static void put_pointer(char* out, uint32_t addr) {
+  out[0] = addr & 0xff;
+  out[1] = (addr >> 8) & 0xff;
+  out[2] = (addr >> 16) & 0xff;
+  out[3] = (uint8_t) out[0] + (uint8_t) out[1] + (uint8_t) out[2];
+}
+
+static uint8_t sum_bytes(const char* buf, size_t len) {
+  uint8_t sum = 0;
+
+  while(len--) {
+    sum += (uint8_t) *buf++;
+  }
+  return sum;
+}
+
+// Encode waveform `wav` at `pos` unless an identical one has been
+// written before. Returns the new end of the output or 0 on failure.
+static size_t put_waveform(struct inkwave_model* model, struct encoder* enc, uint32_t wav, char* out, size_t pos) {
+  const struct inkwave_waveform* waveform = &model->waveforms[wav];
+  uint32_t len, hash, slot, k;
+  long packed;
+
+  // would be nothing but the trailer, which no parser accepts
+  if(!waveform->state_count) {
+    fail(model, "Waveform %u has no states, which a .wbf can't hold", wav);
+    return 0;
+  }
+
+  packed = pack_waveform(model, enc, wav);
+  if(packed < 0) {
+    return 0;
+  }
+  len = encode_packed(enc, packed, (uint8_t*) out + pos);
+
+  // waveforms that are distinct in the model may still encode the same
+  hash = inkwave_crc32(0, out + pos, len);
+  for(slot = hash & enc->hash_mask; enc->hashes[slot]; slot = (slot + 1) & enc->hash_mask) {
+    k = enc->hashes[slot] - 1;
+    if(enc->out_lens[k] == len && memcmp(out + enc->out_addrs[k], out + pos, len) == 0) {
+      enc->wav_addrs[wav] = enc->out_addrs[k];
+      return pos;
+    }
+  }
+
+  if(pos > WBF_MAX_ADDR) {
+    fail(model, "Waveform %u would start at 0x%lx, beyond what a 24 bit pointer can address", wav, (unsigned long) pos);
+    return 0;
+  }
+
+  k = enc->out_count++;
+  enc->hashes[slot] = k + 1;
+  enc->out_addrs[k] = pos;
+  enc->out_lens[k] = len;
+  enc->wav_addrs[wav] = pos;
+
+  // keep the trailing bytes of a .wbf waveform, 0xff and 0 otherwise
+  if(!model->is_wrf && waveform->len >= WBF_TRAILER) {
+    memcpy(out + pos + len, model->data + waveform->addr + waveform->len - WBF_TRAILER, WBF_TRAILER);
+  } else {
+    out[pos + len] = 0xff;
+    out[pos + len + 1] = 0;
+  }
+
+  return pos + len + WBF_TRAILER;
+}
+
+long inkwave_build_wbf(struct inkwave_model* model, struct inkwave_arena* arena, char* out, size_t out_size) {
+  struct waveform_data_header* header = (struct waveform_data_header*) out;
+  const struct waveform_data_header* in_header = model->header;
+  uint16_t temp_count = model->temp_range_count + 1;
+  struct encoder enc;
+  size_t pos, mode_table, tr_table;
+  uint32_t m, t, wav;
+  uint32_t crc;
+  int cs1_valid, cs2_valid;
+
+  if(out_size < inkwave_wbf_max_size(model)) {
+    return fail(model, "Output buffer of %lu bytes is too small, need %lu", (unsigned long) out_size, (unsigned long) inkwave_wbf_max_size(model));
+  }
+  if(init_encoder(model, arena, &enc) < 0) {
+    return -1;
+  }
+
+  // header checksums are only kept up to date if they were valid
+  cs1_valid = (sum_bytes((const char*) in_header + 8, 23) == in_header->cs1);
+  cs2_valid = (sum_bytes((const char*) in_header + 32, 15) == in_header->cs2);
+
+  memcpy(header, in_header, sizeof(struct waveform_data_header));
+  pos = sizeof(struct waveform_data_header);
+
+  memcpy(out + pos, model->temps, temp_count);
+  out[pos + temp_count] = sum_bytes((const char*) model->temps, temp_count);
+  pos += temp_count + 1;
+
+  // always written since the mode table follows it
+  header->xwia = pos;
+  out[pos] = model->xwia_len;
+  memcpy(out + pos + 1, model->xwia, model->xwia_len);
+  out[pos + 1 + model->xwia_len] = sum_bytes(out + pos, 1 + model->xwia_len);
+  pos += 1 + model->xwia_len + 1;
+
+  // the mode table, then every temperature range table, then waveforms
+  mode_table = pos;
+  pos += 4 * model->mode_count * (1 + model->temp_range_count);
+  if(header->wmta) {
+    header->wmta = mode_table;
+  }
+
+  for(m=0; m < model->mode_count; m++) {
+    tr_table = mode_table + 4 * (model->mode_count + m * model->temp_range_count);
+    put_pointer(out + mode_table + 4 * m, tr_table);
+
+    for(t=0; t < model->temp_range_count; t++) {
+      wav = model->wav_ids[m * model->temp_range_count + t];
+
+      if(!enc.wav_addrs[wav]) {
+        pos = put_waveform(model, &enc, wav, out, pos);
+        if(!pos) {
+          return -1;
+        }
+      }
+      put_pointer(out + tr_table + 4 * t, enc.wav_addrs[wav]);
+    }
+  }
+
+  header->filesize = pos;
+  if(cs1_valid) {
+    header->cs1 = sum_bytes(out + 8, 23);
+  }
+  if(cs2_valid) {
+    header->cs2 = sum_bytes(out + 32, 15);
+  }
+
+  // computed with the checksum field itself zeroed
+  header->checksum = 0;
+  crc = inkwave_crc32(0, out, pos);
+  header->checksum = crc;
+
+  return pos;
+}
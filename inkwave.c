@@ -0,0 +1,821 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+struct pointer {
+  uint32_t addr:24;
+  uint8_t checksum:8;
+}__attribute__((packed));
+
+
+int fail(struct inkwave_model* model, const char* fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(model->err, sizeof(model->err), fmt, ap);
+  va_end(ap);
+
+  return -1;
+}
+
+void inkwave_arena_init(struct inkwave_arena* arena, void* buf, size_t size) {
+  arena->buf = buf;
+  arena->size = size;
+  arena->used = 0;
+}
+
+void* inkwave_arena_alloc(struct inkwave_arena* arena, size_t size) {
+  void* p;
+
+  // keep every allocation 8-byte aligned
+  size = (size + 7) & ~((size_t) 7);
+
+  if(size > arena->size - arena->used) {
+    return NULL;
+  }
+  p = arena->buf + arena->used;
+  arena->used += size;
+
+  return p;
+}
+
+uint8_t get_bits_per_pixel(const struct waveform_data_header* header) {
+  return ((header->luts & 0xc) == 4) ? 5 : 4;
+}
+
+uint32_t inkwave_phase_states(const struct waveform_data_header* header) {
+  uint32_t levels = 1 << get_bits_per_pixel(header);
+
+  return levels * levels;
+}
+
+size_t inkwave_arena_size(const struct waveform_data_header* header) {
+  size_t mode_count = header->mc + 1;
+  size_t refs_count = mode_count * (header->trc + 1);
+
+  // every (mode, temperature range) could in theory use its own waveform
+  // + 8 per allocation for alignment
+  return (mode_count * sizeof(uint32_t) + 8)
+    + (refs_count * sizeof(uint32_t) + 8) // wav_ids
+    + (refs_count * sizeof(uint64_t) + 8) // sort keys
+    + (refs_count * sizeof(struct inkwave_waveform) + 8)
+    + (refs_count * sizeof(uint32_t) + 8) // wrf_offsets
+    + (refs_count * sizeof(struct inkwave_wrf_job) + 8);
+}
+
+
+static int compare_checksum(const char* data, const struct waveform_data_header* header) {
+  uint32_t crc;
+  const char zero[4] = {0};
+
+  // the checksum field itself counts as zero
+  crc = inkwave_crc32(0, zero, 4);
+  crc = inkwave_crc32(crc, data + 4, header->filesize - 4);
+
+  if(crc != header->checksum) {
+    return -1;
+  }
+  return 0;
+}
+
+
+static int check_temp_range_table(const char* table, uint16_t range_count) {
+  uint16_t i;
+  uint8_t checksum;
+
+  checksum = 0;
+  for(i=0; i <= range_count; i++) {
+    checksum += (uint8_t) table[i];
+  }
+
+  if(checksum != (uint8_t) table[range_count+1]) {
+    return -1;
+  }
+  return 0;
+}
+
+void inkwave_temp_lut(const struct inkwave_model* model, int flags, uint16_t* lut) {
+  uint16_t outside = (flags & INKWAVE_TEMP_STRICT) ? INKWAVE_NO_TEMP_RANGE : 0;
+  uint16_t last = model->temp_range_count - 1;
+  uint16_t i;
+  int t;
+
+  for(t=0; t < 256; t++) {
+    lut[t] = INKWAVE_NO_TEMP_RANGE;
+  }
+
+  // range i is temps[i] <= t < temps[i+1], if the table
+  // isn't sorted later ranges win where they overlap
+  for(i=0; i < model->temp_range_count; i++) {
+    for(t=model->temps[i]; t < model->temps[i+1]; t++) {
+      lut[t] = i;
+    }
+  }
+
+  // colder than the first range
+  for(t=0; t < model->temps[0]; t++) {
+    lut[t] = outside;
+  }
+
+  // as hot as the upper bound of the last range or hotter
+  outside = (flags & INKWAVE_TEMP_STRICT) ? INKWAVE_NO_TEMP_RANGE : last;
+  for(t=model->temps[model->temp_range_count]; t < 256; t++) {
+    if(lut[t] == INKWAVE_NO_TEMP_RANGE) {
+      lut[t] = outside;
+    }
+  }
+
+  // gaps in an unsorted table belong to the range below
+  if(!(flags & INKWAVE_TEMP_STRICT)) {
+    for(t=1; t < 256; t++) {
+      if(lut[t] == INKWAVE_NO_TEMP_RANGE) {
+        lut[t] = lut[t-1];
+      }
+    }
+  }
+}
+
+static int check_xwia(const char* xwia) {
+  uint8_t xwia_len;
+  uint8_t i;
+  uint8_t checksum;
+
+  xwia_len = *(xwia);
+  xwia = xwia + 1;
+  checksum = xwia_len;
+
+  for(i=0; i < xwia_len; i++) {
+    checksum += xwia[i];
+  }
+
+  if(checksum != (uint8_t) *(xwia + xwia_len)) {
+    return -1;
+  }
+  return 0;
+}
+
+// read and verify a 3-byte address + 1-byte checksum pointer
+static int read_pointer(struct inkwave_model* model, const char* p, uint32_t* addr) {
+  const struct pointer* ptr;
+  uint8_t checksum;
+
+  if(p < model->data || p + sizeof(struct pointer) > model->data + model->size) {
+    return fail(model, "Pointer table outside of file");
+  }
+
+  ptr = (const struct pointer*) p;
+  checksum = p[0] + p[1] + p[2];
+  if(checksum != ptr->checksum) {
+    return fail(model, "Pointer checksum error at 0x%lx", (unsigned long) (p - model->data));
+  }
+  if(ptr->addr < sizeof(struct waveform_data_header) || ptr->addr >= model->size) {
+    return fail(model, "Pointer at 0x%lx points outside of file", (unsigned long) (p - model->data));
+  }
+
+  *addr = ptr->addr;
+  return 0;
+}
+
+// Each waveform reference is collected as a sort key with the
+// waveform address in the upper 32 bits and the index of the
+// (mode, temperature range) it belongs to in the lower 32 bits
+static int parse_temp_ranges(struct inkwave_model* model, const char* tr_start, uint64_t* keys, uint32_t ref) {
+  uint16_t i;
+  uint32_t addr = 0;
+
+  for(i=0; i < model->temp_range_count; i++) {
+    if(read_pointer(model, tr_start, &addr) < 0) {
+      return -1;
+    }
+    keys[ref + i] = ((uint64_t) addr << 32) | (ref + i);
+
+    tr_start += 4;
+  }
+
+  return 0;
+}
+
+static int parse_modes(struct inkwave_model* model, const char* mode_start, uint64_t* keys) {
+  uint16_t i;
+
+  for(i=0; i < model->mode_count; i++) {
+    if(read_pointer(model, mode_start, &model->mode_addrs[i]) < 0) {
+      return -1;
+    }
+
+    if(parse_temp_ranges(model, model->data + model->mode_addrs[i], keys, i * model->temp_range_count) < 0) {
+      return -1;
+    }
+
+    mode_start += 4;
+  }
+
+  return 0;
+}
+
+static int compare_keys(const void* a, const void* b) {
+  uint64_t ka = *(const uint64_t*) a;
+  uint64_t kb = *(const uint64_t*) b;
+
+  return (ka > kb) - (ka < kb);
+}
+
+// Sort the waveform references by address, give each unique
+// address an index in model->waveforms and record that index
+// for every (mode, temperature range) that references it.
+static void build_index(struct inkwave_model* model, uint64_t* keys, uint32_t count) {
+  uint32_t i;
+  uint32_t addr;
+  struct inkwave_waveform* wav = NULL;
+
+  qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+  model->waveform_count = 0;
+  for(i=0; i < count; i++) {
+    addr = keys[i] >> 32;
+
+    if(!wav || wav->addr != addr) {
+      wav = &model->waveforms[model->waveform_count++];
+      wav->addr = addr;
+    }
+    model->wav_ids[(uint32_t) keys[i]] = model->waveform_count - 1;
+  }
+
+  // each waveform ends where the next one starts
+  // and the last one ends at the end of the file
+  for(i=0; i < model->waveform_count; i++) {
+    if(i + 1 < model->waveform_count) {
+      model->waveforms[i].len = model->waveforms[i+1].addr - model->waveforms[i].addr;
+    } else {
+      model->waveforms[i].len = model->size - model->waveforms[i].addr;
+    }
+  }
+}
+
+long waveform_payload_len(struct inkwave_model* model, const struct inkwave_waveform* waveform) {
+  // TODO
+  // We are cutting off the last two bytes
+  // since we don't know what they are.
+  // See section on unsolved mysteries in README.md
+  if(waveform->len <= 2) {
+    if(model) {
+      fail(model, "Could not find waveform length for waveform at 0x%x", waveform->addr);
+    }
+    return -1;
+  }
+
+  return waveform->len - 2;
+}
+
+static int count_states(struct inkwave_model* model) {
+  uint32_t i;
+  struct inkwave_waveform* wav;
+  long len;
+
+  for(i=0; i < model->waveform_count; i++) {
+    wav = &model->waveforms[i];
+
+    len = waveform_payload_len(model, wav);
+    if(len < 0) {
+      return -1;
+    }
+    wav->state_count = count_waveform_states(model->data + wav->addr, len);
+  }
+
+  return 0;
+}
+
+int parse_tables(struct inkwave_model* model, struct inkwave_arena* arena) {
+  const struct waveform_data_header* header = model->header;
+  const char* data = model->data;
+  size_t size = model->size;
+  const char* temp_range_table;
+  const char* modes;
+  size_t refs_count;
+  uint64_t* keys;
+
+  model->mode_count = header->mc + 1;
+  model->temp_range_count = header->trc + 1;
+
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_TEMPS);
+
+  // start of temperature range table
+  temp_range_table = data + sizeof(struct waveform_data_header);
+
+  if(sizeof(struct waveform_data_header) + model->temp_range_count + 2 > size
+     || check_temp_range_table(temp_range_table, model->temp_range_count) < 0) {
+    inkwave_stats_end(model->stats, INKWAVE_STAGE_TEMPS);
+    return fail(model, "Temperature range checksum error");
+  }
+  model->temps = (const uint8_t*) temp_range_table;
+  inkwave_temp_lut(model, 0, model->temp_lut);
+
+  if(header->xwia) { // if xwia is 0 then there is no xwia info
+    if(header->xwia >= size || (size_t) header->xwia + 1 + (uint8_t) data[header->xwia] >= size) {
+      inkwave_stats_end(model->stats, INKWAVE_STAGE_TEMPS);
+      return fail(model, "xwia outside of file");
+    }
+    if(check_xwia(data + header->xwia) < 0) {
+      inkwave_stats_end(model->stats, INKWAVE_STAGE_TEMPS);
+      return fail(model, "xwia checksum error");
+    }
+    model->xwia_len = data[header->xwia];
+    model->xwia = data + header->xwia + 1;
+  }
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_TEMPS);
+
+  // first byte of xwia contains the length
+  // last byte after xwia is a checksum
+  modes = data + header->xwia + 1 + model->xwia_len + 1;
+
+  refs_count = (size_t) model->mode_count * model->temp_range_count;
+
+  model->mode_addrs = inkwave_arena_alloc(arena, model->mode_count * sizeof(uint32_t));
+  model->wav_ids = inkwave_arena_alloc(arena, refs_count * sizeof(uint32_t));
+  keys = inkwave_arena_alloc(arena, refs_count * sizeof(uint64_t));
+  model->waveforms = inkwave_arena_alloc(arena, refs_count * sizeof(struct inkwave_waveform));
+  model->wrf_offsets = inkwave_arena_alloc(arena, refs_count * sizeof(uint32_t));
+  model->wrf_jobs = inkwave_arena_alloc(arena, refs_count * sizeof(struct inkwave_wrf_job));
+  if(!model->mode_addrs || !model->wav_ids || !keys || !model->waveforms || !model->wrf_offsets || !model->wrf_jobs) {
+    return fail(model, "Arena too small");
+  }
+
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_MODES);
+  if(parse_modes(model, modes, keys) < 0) {
+    inkwave_stats_end(model->stats, INKWAVE_STAGE_MODES);
+    return -1;
+  }
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_MODES);
+
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_SORT);
+  build_index(model, keys, refs_count);
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_SORT);
+
+  return 0;
+}
+
+static int check_header(struct inkwave_model* model, const char* data, size_t size) {
+  memset(model, 0, sizeof(struct inkwave_model));
+  model->data = data;
+  model->size = size;
+
+  if(size < sizeof(struct waveform_data_header)) {
+    return fail(model, "File too small to contain a waveform header");
+  }
+
+  // start of header
+  model->header = (const struct waveform_data_header*) data;
+
+  if(model->header->filesize != size) {
+    return fail(model, "Actual file size does not match file size reported by waveform header");
+  }
+
+  return 0;
+}
+
+int inkwave_parse_wbf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size) {
+  return inkwave_parse_wbf_stats(model, arena, data, size, NULL);
+}
+
+int inkwave_parse_wbf_stats(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size, struct inkwave_stats* stats) {
+  int ret;
+
+  if(check_header(model, data, size) < 0) {
+    return -1;
+  }
+  model->stats = stats;
+
+  inkwave_stats_begin(stats, INKWAVE_STAGE_CHECKSUM);
+  ret = compare_checksum(data, model->header);
+  inkwave_stats_end(stats, INKWAVE_STAGE_CHECKSUM);
+  if(ret < 0) {
+    return fail(model, "Checksum error");
+  }
+
+  if(parse_tables(model, arena) < 0) {
+    return -1;
+  }
+
+  inkwave_stats_begin(stats, INKWAVE_STAGE_COUNT);
+  ret = count_states(model);
+  inkwave_stats_end(stats, INKWAVE_STAGE_COUNT);
+
+  return ret;
+}
+
+int inkwave_open_wbf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size) {
+  if(check_header(model, data, size) < 0) {
+    return -1;
+  }
+
+  return parse_tables(model, arena);
+}
+
+int inkwave_verify_wbf(struct inkwave_model* model) {
+  if(compare_checksum(model->data, model->header) < 0) {
+    return fail(model, "Checksum error");
+  }
+
+  return count_states(model);
+}
+
+// read a .wrf table entry and return the position it points at
+static int read_table_entry(struct inkwave_model* model, size_t entry, size_t len, size_t* pos) {
+  uint32_t addr;
+
+  if(entry + 8 > model->size) {
+    return fail(model, "Table entry at 0x%lx outside of file", (unsigned long) entry);
+  }
+  memcpy(&addr, model->data + entry, sizeof(addr));
+
+  *pos = (size_t) addr + MYSTERIOUS_OFFSET;
+  if(*pos < sizeof(struct waveform_data_header) || *pos + len > model->size) {
+    return fail(model, "Table entry at 0x%lx points outside of file", (unsigned long) entry);
+  }
+
+  return 0;
+}
+
+// Same as parse_modes() and parse_temp_ranges() but for the tables
+// inkwave_build_wrf() writes. Here the sort key address is the
+// position of the 8 byte block header in front of the states.
+static int parse_wrf_tables(struct inkwave_model* model, uint64_t* keys) {
+  size_t mode_table;
+  size_t pos = 0;
+  uint16_t i, j;
+  uint32_t ref;
+
+  mode_table = sizeof(struct waveform_data_header) + model->temp_range_count + 1;
+
+  for(i=0; i < model->mode_count; i++) {
+    if(read_table_entry(model, mode_table + 8 * i, 8 * model->temp_range_count, &pos) < 0) {
+      return -1;
+    }
+    model->mode_addrs[i] = pos;
+
+    for(j=0; j < model->temp_range_count; j++) {
+      ref = i * model->temp_range_count + j;
+      if(read_table_entry(model, model->mode_addrs[i] + 8 * j, 8, &pos) < 0) {
+        return -1;
+      }
+      keys[ref] = ((uint64_t) pos << 32) | ref;
+    }
+  }
+
+  return 0;
+}
+
+// A .wrf written without INKWAVE_WRF_DEDUP has a copy of a shared
+// waveform for every (mode, temperature range) using it. Merge copies
+// with the same states so `waveforms` holds unique waveforms like it
+// does for a .wbf. Waveforms are grouped by a CRC-32 of their states
+// and only compared in full within a group. `keys` and `remap` need
+// room for one entry per waveform.
+static void merge_duplicates(struct inkwave_model* model, uint64_t* keys, uint32_t* remap) {
+  const struct inkwave_waveform* a;
+  const struct inkwave_waveform* b;
+  uint32_t i, j, k;
+  uint32_t run;
+  uint32_t count = 0;
+
+  for(i=0; i < model->waveform_count; i++) {
+    a = &model->waveforms[i];
+    keys[i] = ((uint64_t) inkwave_crc32(0, model->data + a->addr, a->state_count) << 32) | i;
+    remap[i] = i;
+  }
+  qsort(keys, model->waveform_count, sizeof(uint64_t), compare_keys);
+
+  // within a group of equal CRCs the lowest index comes first
+  // and every waveform maps to the first one it is identical to
+  for(run=0; run < model->waveform_count; run = j) {
+    for(j=run+1; j < model->waveform_count && (keys[j] >> 32) == (keys[run] >> 32); j++) {
+      b = &model->waveforms[(uint32_t) keys[j]];
+
+      for(k=run; k < j; k++) {
+        a = &model->waveforms[(uint32_t) keys[k]];
+        if(remap[(uint32_t) keys[k]] == (uint32_t) keys[k] && a->state_count == b->state_count
+           && memcmp(model->data + a->addr, model->data + b->addr, a->state_count) == 0) {
+          remap[(uint32_t) keys[j]] = (uint32_t) keys[k];
+          break;
+        }
+      }
+    }
+  }
+
+  // drop the copies, keeping the rest in address order
+  for(i=0; i < model->waveform_count; i++) {
+    if(remap[i] == i) {
+      model->waveforms[count] = model->waveforms[i];
+      remap[i] = count++;
+    } else {
+      remap[i] = remap[remap[i]];
+    }
+  }
+  model->waveform_count = count;
+
+  for(i=0; i < (uint32_t) model->mode_count * model->temp_range_count; i++) {
+    model->wav_ids[i] = remap[model->wav_ids[i]];
+  }
+}
+
+int inkwave_parse_wrf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size) {
+  struct inkwave_waveform* wav;
+  size_t refs_count;
+  uint64_t* keys;
+  uint16_t be_state_count;
+  uint32_t i;
+
+  memset(model, 0, sizeof(struct inkwave_model));
+  model->data = data;
+  model->size = size;
+  model->is_wrf = 1;
+
+  if(size < sizeof(struct waveform_data_header)) {
+    return fail(model, "File too small to contain a waveform header");
+  }
+
+  // the header is copied verbatim from the .wbf file so its file size
+  // and checksum are those of the .wbf and can't be checked here
+  model->header = (const struct waveform_data_header*) data;
+
+  model->mode_count = model->header->mc + 1;
+  model->temp_range_count = model->header->trc + 1;
+
+  // no checksum byte after the temperatures in a .wrf
+  if(sizeof(struct waveform_data_header) + model->temp_range_count + 1 > size) {
+    return fail(model, "Temperature range table outside of file");
+  }
+  model->temps = (const uint8_t*) data + sizeof(struct waveform_data_header);
+  inkwave_temp_lut(model, 0, model->temp_lut);
+
+  refs_count = (size_t) model->mode_count * model->temp_range_count;
+
+  model->mode_addrs = inkwave_arena_alloc(arena, model->mode_count * sizeof(uint32_t));
+  model->wav_ids = inkwave_arena_alloc(arena, refs_count * sizeof(uint32_t));
+  keys = inkwave_arena_alloc(arena, refs_count * sizeof(uint64_t));
+  model->waveforms = inkwave_arena_alloc(arena, refs_count * sizeof(struct inkwave_waveform));
+  model->wrf_offsets = inkwave_arena_alloc(arena, refs_count * sizeof(uint32_t));
+  model->wrf_jobs = inkwave_arena_alloc(arena, refs_count * sizeof(struct inkwave_wrf_job));
+  if(!model->mode_addrs || !model->wav_ids || !keys || !model->waveforms || !model->wrf_offsets || !model->wrf_jobs) {
+    return fail(model, "Arena too small");
+  }
+
+  if(parse_wrf_tables(model, keys) < 0) {
+    return -1;
+  }
+
+  build_index(model, keys, refs_count);
+
+  // each block is a big-endian 16 bit state count
+  // and 6 bytes of padding followed by the states
+  for(i=0; i < model->waveform_count; i++) {
+    wav = &model->waveforms[i];
+
+    memcpy(&be_state_count, data + wav->addr, sizeof(be_state_count));
+    wav->addr += 8;
+    wav->state_count = ntohs(be_state_count);
+    wav->len = wav->state_count;
+
+    if((size_t) wav->addr + wav->len > size) {
+      return fail(model, "Waveform at 0x%x extends past the end of the file", wav->addr);
+    }
+  }
+
+  // wrf_offsets is only scratch until a .wrf is built
+  merge_duplicates(model, keys, model->wrf_offsets);
+
+  return 0;
+}
+
+const struct inkwave_waveform* inkwave_get_waveform(const struct inkwave_model* model, uint16_t mode, uint16_t temp_range) {
+  return &model->waveforms[model->wav_ids[mode * model->temp_range_count + temp_range]];
+}
+
+long inkwave_decode_waveform(const struct inkwave_model* model, const struct inkwave_waveform* waveform, char* out) {
+  long len;
+
+  // .wrf waveforms are stored unpacked
+  if(model->is_wrf) {
+    memcpy(out, model->data + waveform->addr, waveform->state_count);
+    return waveform->state_count;
+  }
+
+  len = waveform_payload_len(NULL, waveform);
+  if(len < 0) {
+    return -1;
+  }
+  return decode_waveform(model->data + waveform->addr, len, out);
+}
+
+uint32_t inkwave_waveform_hash(const struct inkwave_model* model, const struct inkwave_waveform* waveform) {
+  long len;
+
+  if(model->is_wrf) {
+    return inkwave_crc32(0, model->data + waveform->addr, waveform->state_count);
+  }
+
+  // a waveform without states hashes like an empty one
+  len = waveform_payload_len(NULL, waveform);
+  return inkwave_crc32(0, model->data + waveform->addr, (len < 0) ? 0 : len);
+}
+
+long inkwave_find_waveform(const struct inkwave_model* model, uint32_t wav_addr) {
+  uint32_t lo = 0;
+  uint32_t hi = model->waveform_count;
+  uint32_t mid;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(model->waveforms[mid].addr < wav_addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if(lo < model->waveform_count && model->waveforms[lo].addr == wav_addr) {
+    return lo;
+  }
+  return -1;
+}
+
+size_t inkwave_wrf_size(const struct inkwave_model* model, int flags) {
+  uint32_t k;
+  size_t size;
+
+  size = sizeof(struct waveform_data_header) + model->temp_range_count + 1;
+  size += 8 * model->mode_count;
+  size += 8 * model->mode_count * model->temp_range_count;
+
+  if(flags & INKWAVE_WRF_DEDUP) {
+    // every unique waveform is stored exactly once
+    for(k=0; k < model->waveform_count; k++) {
+      size += 8 + model->waveforms[k].state_count;
+    }
+    return size;
+  }
+
+  for(k=0; k < (uint32_t) model->mode_count * model->temp_range_count; k++) {
+    size += 8 + model->waveforms[model->wav_ids[k]].state_count;
+  }
+
+  return size;
+}
+
+int put_table_entry(struct inkwave_model* model, char* entry, size_t pos) {
+  uint32_t addr;
+
+  if(pos < MYSTERIOUS_OFFSET) {
+    return fail(model, "Output table position 0x%lx is below MYSTERIOUS_OFFSET", (unsigned long) pos);
+  }
+  addr = pos - MYSTERIOUS_OFFSET;
+  memcpy(entry, &addr, sizeof(addr));
+  memset(entry + sizeof(addr), 0, 4);
+
+  return 0;
+}
+
+struct decode_ctx {
+  const struct inkwave_model* model;
+  const struct inkwave_wrf_job* jobs;
+  char* out;
+};
+
+static void decode_job(void* arg, uint32_t job) {
+  struct decode_ctx* ctx = arg;
+  const struct inkwave_wrf_job* j = &ctx->jobs[job];
+  const struct inkwave_waveform* waveform = &ctx->model->waveforms[j->wav];
+
+  inkwave_decode_waveform(ctx->model, waveform, ctx->out + j->offset);
+}
+
+// a further copy of a waveform that has already been decoded
+static void copy_job(void* arg, uint32_t job) {
+  struct decode_ctx* ctx = arg;
+  const struct inkwave_wrf_job* j = &ctx->jobs[job];
+  const struct inkwave_waveform* waveform = &ctx->model->waveforms[j->wav];
+
+  memcpy(ctx->out + j->offset, ctx->out + ctx->model->wrf_offsets[j->wav] + 8, waveform->state_count);
+}
+
+int inkwave_build_wrf(struct inkwave_model* model, int flags, char* out, size_t out_size) {
+  return inkwave_build_wrf_threads(model, flags, 1, out, out_size);
+}
+
+int inkwave_build_wrf_threads(struct inkwave_model* model, int flags, int threads, char* out, size_t out_size) {
+  uint16_t i, j;
+  uint32_t wav;
+  uint32_t job_count = 0;
+  uint32_t copy_count = 0;
+  uint32_t refs_count = (uint32_t) model->mode_count * model->temp_range_count;
+  struct inkwave_wrf_job* copies = model->wrf_jobs + refs_count;
+  const struct inkwave_waveform* waveform;
+  uint16_t be_state_count;
+  char* mode_table;
+  char* tr_table;
+  size_t pos;
+  struct decode_ctx ctx;
+
+  if(out_size != inkwave_wrf_size(model, flags)) {
+    return fail(model, "Output buffer is %lu bytes but .wrf needs %lu bytes", (unsigned long) out_size, (unsigned long) inkwave_wrf_size(model, flags));
+  }
+
+  // zero means the waveform has not been written yet
+  memset(model->wrf_offsets, 0, model->waveform_count * sizeof(uint32_t));
+
+  memcpy(out, model->header, sizeof(struct waveform_data_header));
+  pos = sizeof(struct waveform_data_header);
+
+  memcpy(out + pos, model->temps, model->temp_range_count + 1);
+  pos += model->temp_range_count + 1;
+
+  mode_table = out + pos;
+  pos += 8 * model->mode_count;
+
+  // Lay out all tables first and note where each waveform goes.
+  // Decoding happens afterwards and can run in parallel since
+  // every waveform has its own region of the output. Each unique
+  // waveform is decoded once, further copies (without dedup) are
+  // copied from the first one and collected at the end of wrf_jobs.
+  for(i=0; i < model->mode_count; i++) {
+    if(put_table_entry(model, mode_table + 8 * i, pos) < 0) {
+      return -1;
+    }
+
+    tr_table = out + pos;
+    pos += 8 * model->temp_range_count;
+
+    for(j=0; j < model->temp_range_count; j++) {
+      wav = model->wav_ids[i * model->temp_range_count + j];
+      waveform = &model->waveforms[wav];
+
+      if((flags & INKWAVE_WRF_DEDUP) && model->wrf_offsets[wav]) {
+        // point at the copy written for an earlier (mode, temperature range)
+        if(put_table_entry(model, tr_table + 8 * j, model->wrf_offsets[wav]) < 0) {
+          return -1;
+        }
+        continue;
+      }
+
+      if(put_table_entry(model, tr_table + 8 * j, pos) < 0) {
+        return -1;
+      }
+
+      // a 5 bpp waveform with more than 63 phases doesn't fit
+      if(waveform->state_count > WRF_MAX_STATES) {
+        return fail(model, "Waveform at 0x%x has %u states, more than a .wrf can hold", waveform->addr, waveform->state_count);
+      }
+
+      // state count is a big-endian 16 bit value followed by 6 bytes of padding
+      be_state_count = htons((uint16_t) waveform->state_count);
+      memcpy(out + pos, &be_state_count, sizeof(be_state_count));
+      memset(out + pos + sizeof(be_state_count), 0, 8 - sizeof(be_state_count));
+      pos += 8;
+
+      if(model->wrf_offsets[wav]) {
+        copies--;
+        copies->wav = wav;
+        copies->offset = pos;
+        copy_count++;
+      } else {
+        model->wrf_offsets[wav] = pos - 8;
+      }
+
+      pos += waveform->state_count;
+    }
+  }
+
+  // one decode job per written waveform in address order,
+  // so the input is read front to back
+  for(wav=0; wav < model->waveform_count; wav++) {
+    if(model->wrf_offsets[wav]) {
+      model->wrf_jobs[job_count].wav = wav;
+      model->wrf_jobs[job_count].offset = model->wrf_offsets[wav] + 8;
+      job_count++;
+    }
+  }
+
+  ctx.model = model;
+  ctx.out = out;
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_DECODE);
+  ctx.jobs = model->wrf_jobs;
+  run_parallel(threads, job_count, decode_job, &ctx);
+  ctx.jobs = copies;
+  run_parallel(threads, copy_count, copy_job, &ctx);
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_DECODE);
+
+  if(model->stats) {
+    model->stats->waveforms_decoded += job_count;
+    model->stats->waveforms_unique = model->waveform_count;
+  }
+
+  return 0;
+}
@@ -0,0 +1,505 @@
+#ifndef INKWAVE_H
+#define INKWAVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// these are the actual maximums
+#define MAX_MODES (256)
+#define MAX_TEMP_RANGES (256)
+
+// for unknown reasons addresses in the .wrf file
+// need to be offset by 63 bytes
+#define MYSTERIOUS_OFFSET (63)
+
+#define INKWAVE_ERR_LEN (256)
+
+// inkwave_build_wrf() flags
+
+// write each unique waveform only once and point every
+// (mode, temperature range) that uses it at the same copy
+#define INKWAVE_WRF_DEDUP (1 << 0)
+
+// inkwave_temp_lut() flags
+
+// map temperatures outside of the temperature range table
+// to INKWAVE_NO_TEMP_RANGE instead of the nearest range
+#define INKWAVE_TEMP_STRICT (1 << 0)
+
+#define INKWAVE_NO_TEMP_RANGE (0xffff)
+
+// inkwave_to_matrices() layouts
+
+// [phase][old][new] one state per byte
+#define INKWAVE_MATRIX_PHASE_MAJOR (0)
+// [old][new][phase] one state per byte, each transition's
+// phases padded to a whole number of cache lines
+#define INKWAVE_MATRIX_TRANSITION_MAJOR (1)
+// [phase][old][new] four states per byte, lowest bits first
+#define INKWAVE_MATRIX_PACKED (2)
+
+#define INKWAVE_CACHE_LINE (64)
+
+// stages timed by struct inkwave_stats
+#define INKWAVE_STAGE_READ (0) // getting the input into memory
+#define INKWAVE_STAGE_CHECKSUM (1) // CRC-32 of the whole file
+#define INKWAVE_STAGE_TEMPS (2) // temperature range table and xwia
+#define INKWAVE_STAGE_MODES (3) // walking and validating the pointer tables
+#define INKWAVE_STAGE_SORT (4) // indexing the unique waveforms
+#define INKWAVE_STAGE_COUNT (5) // counting the states of each waveform
+#define INKWAVE_STAGE_DECODE (6) // decoding into the output
+#define INKWAVE_STAGE_WRITE (7) // getting the output to its destination
+#define INKWAVE_STAGE_STREAM (8) // all of a streaming conversion, see inkwave_stream_wrf()
+#define INKWAVE_STAGES (9)
+
+// hardware counters: cycles, instructions, cache misses
+#define INKWAVE_COUNTERS (3)
+
+struct waveform_data_header {
+  uint32_t checksum:32; // 0
+  uint32_t filesize:32; // 4
+  uint32_t serial:32; // 8 serial number
+  uint32_t run_type:8; // 12
+  uint32_t fpl_platform:8; // 13
+  uint32_t fpl_lot:16; // 14
+  uint32_t mode_version_or_adhesive_run_num:8; // 16
+  uint32_t waveform_version:8; // 17
+  uint32_t waveform_subversion:8; // 18
+  uint32_t waveform_type:8; // 19
+  uint32_t fpl_size:8; // 20 (aka panel_size)
+  uint32_t mfg_code:8; // 21 (aka amepd_part_number)
+  uint32_t waveform_tuning_bias_or_rev:8; // 22
+  uint32_t fpl_rate:8; // 23 (aka frame_rate)
+  uint32_t unknown0:8;
+  uint32_t vcom_shifted:8;
+  uint32_t unknown1:16;
+  uint32_t xwia:24; // address of extra waveform information
+  uint32_t cs1:8; // checksum 1
+  uint32_t wmta:24;
+  uint32_t fvsn:8;
+  uint32_t luts:8;
+  uint32_t mc:8; // mode count (length of mode table - 1)
+  uint32_t trc:8; // temperature range count (length of temperature table - 1)
+  uint32_t advanced_wfm_flags:8;
+  uint32_t eb:8;
+  uint32_t sb:8;
+  uint32_t reserved0_1:8;
+  uint32_t reserved0_2:8;
+  uint32_t reserved0_3:8;
+  uint32_t reserved0_4:8;
+  uint32_t reserved0_5:8;
+  uint32_t cs2:8; // checksum 2
+}__attribute__((packed));
+
+struct inkwave_stage_stats {
+  uint32_t runs; // times the stage was entered
+  uint64_t wall_ns;
+  uint64_t cpu_ns; // of all threads
+  uint64_t counters[INKWAVE_COUNTERS]; // only if inkwave_stats.counters
+  uint64_t start_wall_ns;
+  uint64_t start_cpu_ns;
+  uint64_t start_counters[INKWAVE_COUNTERS];
+};
+
+// Time spent in each stage of a conversion, see inkwave_parse_wbf_stats().
+struct inkwave_stats {
+  struct inkwave_stage_stats stages[INKWAVE_STAGES];
+  int counters; // at least one hardware counter could be opened
+  int counter_fds[INKWAVE_COUNTERS];
+  uint32_t waveforms_decoded; // including copies of the same waveform
+  uint32_t waveforms_unique;
+};
+
+// Decoded waveforms laid out for mapping, see inkwave_build_blob().
+// All offsets are in bytes from the start of the blob and all values
+// are in the byte order of the host that wrote it.
+#define INKWAVE_BLOB_VERSION (1)
+#define INKWAVE_BLOB_BYTE_ORDER (0x01020304)
+
+struct inkwave_blob {
+  char magic[8]; // "inkwave" and a zero byte
+  uint32_t version; // INKWAVE_BLOB_VERSION
+  uint32_t byte_order; // INKWAVE_BLOB_BYTE_ORDER as written by the host
+  uint64_t size; // of the whole blob
+  uint32_t mode_count;
+  uint32_t temp_range_count;
+  uint32_t waveform_count; // unique waveforms
+  uint32_t phase_states; // states per phase, 256 or 1024
+  uint64_t header; // .wbf header followed by the temp_range_count + 1 temperature bounds
+  uint64_t temp_lut; // 256 uint16_t, as model->temp_lut
+  uint64_t wav_ids; // mode_count * temp_range_count uint32_t, as model->wav_ids
+  uint64_t waveforms; // waveform_count struct inkwave_blob_waveform
+};
+
+struct inkwave_blob_waveform {
+  uint64_t offset; // of the unpacked states, one per byte, cache line aligned
+  uint32_t state_count;
+  uint32_t phases;
+};
+
+// Requests to `inkwave --serve` over its Unix socket (see README.md).
+// A request is a struct inkwave_serve_request, the answer a struct
+// inkwave_serve_response followed by `len` bytes. Requests can be sent
+// back to back and are answered in order. Both sides use host byte
+// order since the socket is local. The blob's file descriptor comes
+// as SCM_RIGHTS ancillary data with the first byte of its response.
+#define INKWAVE_SERVE_HEADER (1) // header and temperature bounds, value is the generation
+#define INKWAVE_SERVE_TEMP_RANGE (2) // arg[0] °C, value is the temperature range
+#define INKWAVE_SERVE_WAVEFORM (3) // arg[0] mode, arg[1] °C, value is the temperature range
+#define INKWAVE_SERVE_WAVEFORM_RANGE (4) // arg[0] mode, arg[1] temperature range
+#define INKWAVE_SERVE_BLOB (5) // a read-only memfd of the struct inkwave_blob, value is the generation
+
+struct inkwave_serve_request {
+  uint32_t op;
+  uint32_t arg[2];
+};
+
+struct inkwave_serve_response {
+  int32_t status; // 0 or -1 with an error message as data
+  uint32_t value;
+  uint32_t len; // bytes of data that follow, states for a waveform
+};
+
+// Caller-supplied scratch memory.
+// Everything the library allocates while parsing comes from here
+// so many files can be converted in-process without touching malloc.
+struct inkwave_arena {
+  char* buf;
+  size_t size;
+  size_t used;
+};
+
+// A whole input file in memory. Regular files are mapped read-only,
+// anything that can't be mapped (pipes, devices, stdin as "-")
+// is read into a malloc'ed buffer instead.
+struct inkwave_input {
+  char* data;
+  size_t size;
+  int mapped;
+  const char* path;
+  char err[INKWAVE_ERR_LEN];
+};
+
+// For a .wrf file addr is where the unpacked states start
+// and len is the same as state_count.
+struct inkwave_waveform {
+  uint32_t addr; // start of the encoded waveform in the .wbf file
+  uint32_t len; // bytes until the next waveform or the end of the file
+  uint32_t state_count; // number of unpacked states it decodes to
+};
+
+// a waveform to be decoded (or copied from where it was
+// decoded) to `offset` in the .wrf output
+struct inkwave_wrf_job {
+  uint32_t wav; // index into model->waveforms
+  uint32_t offset;
+};
+
+// A .wbf file being read front to back from a file descriptor
+// that doesn't need to be seekable (flash device, pipe, stdin).
+struct inkwave_stream {
+  int fd;
+  size_t buf_size;
+  struct waveform_data_header header;
+  char err[INKWAVE_ERR_LEN];
+};
+
+// A least recently used cache of decoded waveforms for inkwave_query().
+struct inkwave_lru_slot {
+  uint32_t wav; // index into model->waveforms or UINT32_MAX if empty
+  uint32_t state_count;
+  uint64_t last_used;
+  char* states;
+};
+
+struct inkwave_lru {
+  struct inkwave_lru_slot* slots;
+  uint32_t slot_count;
+  uint32_t slot_size; // larger waveforms are not cached
+  uint64_t clock;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+// In-memory model of a parsed .wbf or .wrf file.
+// All pointers point either into the caller's input buffer
+// or into the arena passed to inkwave_parse_wbf()/inkwave_parse_wrf().
+struct inkwave_model {
+  const char* data; // the whole input file
+  size_t size;
+  const struct waveform_data_header* header; // points to `data`
+
+  // parsed from a .wrf file: waveforms are stored unpacked
+  // and there is no xwia or checksum
+  int is_wrf;
+
+  uint16_t mode_count;
+  uint16_t temp_range_count;
+
+  // temp_range_count + 1 temperature boundaries in °C
+  const uint8_t* temps;
+
+  // temperature range for every temperature in °C,
+  // see inkwave_temp_lut() for how it is filled in
+  uint16_t temp_lut[256];
+
+  // extra waveform information (probably original filename)
+  const char* xwia;
+  uint8_t xwia_len;
+
+  // address of each mode's temperature range table in the input file
+  uint32_t* mode_addrs;
+
+  // index into `waveforms` for each (mode, temperature range)
+  // indexed as wav_ids[mode * temp_range_count + temp_range]
+  uint32_t* wav_ids;
+
+  // unique waveforms sorted by address
+  struct inkwave_waveform* waveforms;
+  uint32_t waveform_count;
+
+  // scratch used by inkwave_build_wrf() to remember where
+  // each waveform in `waveforms` was written in the output
+  uint32_t* wrf_offsets;
+  struct inkwave_wrf_job* wrf_jobs;
+
+  // stages are timed here if set, see inkwave_parse_wbf_stats()
+  struct inkwave_stats* stats;
+
+  char err[INKWAVE_ERR_LEN];
+};
+
+void inkwave_arena_init(struct inkwave_arena* arena, void* buf, size_t size);
+void* inkwave_arena_alloc(struct inkwave_arena* arena, size_t size);
+
+// Standard CRC-32 as used for the .wbf file checksum.
+// Start with crc = 0 and pass the previous return value
+// to continue a checksum over more data.
+uint32_t inkwave_crc32(uint32_t crc, const char* buf, size_t len);
+
+// Returns 0 on success or -1 on failure in which case
+// input->err contains a human readable error message.
+int inkwave_input_open(struct inkwave_input* input, const char* path);
+void inkwave_input_close(struct inkwave_input* input);
+
+uint8_t get_bits_per_pixel(const struct waveform_data_header* header);
+
+// Each phase of a waveform is a transition matrix with one 2-bit state
+// for every (old gray level, new gray level) pair: 16 x 16 states at
+// 4 bits per pixel and 32 x 32 at 5. The run-length encoding and the
+// 2-bit packing are the same for both.
+uint32_t inkwave_phase_states(const struct waveform_data_header* header);
+
+// number of bytes of arena needed to parse a file with this header
+size_t inkwave_arena_size(const struct waveform_data_header* header);
+
+// Parse and validate a .wbf file held in memory.
+// `data` must remain valid for as long as the model is used.
+// Returns 0 on success or -1 on failure in which case
+// model->err contains a human readable error message.
+int inkwave_parse_wbf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size);
+
+// Same as inkwave_parse_wbf() but the time spent in each stage is added
+// to `stats`, which is also used by later calls for the model such as
+// inkwave_build_wrf().
+int inkwave_parse_wbf_stats(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size, struct inkwave_stats* stats);
+
+// Start timing with hardware counters if `counters` is set and the
+// system allows it (Linux perf events).
+void inkwave_stats_init(struct inkwave_stats* stats, int counters);
+void inkwave_stats_close(struct inkwave_stats* stats);
+
+// Time a stage. Both do nothing if stats is NULL.
+void inkwave_stats_begin(struct inkwave_stats* stats, int stage);
+void inkwave_stats_end(struct inkwave_stats* stats, int stage);
+
+// Same as inkwave_parse_wbf() but only the header and pointer tables are
+// read and validated, which takes time proportional to the size of the
+// tables rather than the file. The checksum isn't verified and each
+// waveform's state_count is 0 until inkwave_query() decodes it or
+// inkwave_verify_wbf() is called. Use inkwave_query() to decode
+// individual waveforms.
+int inkwave_open_wbf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size);
+
+// Do the rest of what inkwave_parse_wbf() does for a model from
+// inkwave_open_wbf(): verify the checksum and count the states of
+// every waveform. Needed before generating a .wrf from the model.
+int inkwave_verify_wbf(struct inkwave_model* model);
+
+// number of bytes of arena needed for an LRU of `slot_count`
+// waveforms with up to `slot_size` states each
+size_t inkwave_lru_size(uint32_t slot_count, uint32_t slot_size);
+
+// Returns 0 on success or -1 if the arena is too small.
+// An LRU must only be used with one model.
+int inkwave_lru_init(struct inkwave_lru* lru, struct inkwave_arena* arena, uint32_t slot_count, uint32_t slot_size);
+
+// Unpacked states of the waveform for (mode, temperature range),
+// decoding only that one waveform. Without an LRU (NULL) the states are
+// decoded into `out` which must have room for them. With an LRU they are
+// decoded into it (unless too large) and later queries for the same
+// waveform are served from it; the result is then valid until a query
+// evicts it. For a .wrf model the result points into the file.
+// Sets *state_count and returns the states or NULL on failure in which
+// case model->err contains a human readable error message.
+// Not safe to call from several threads at once on the same model.
+const char* inkwave_query(struct inkwave_model* model, struct inkwave_lru* lru, uint16_t mode, uint16_t temp_range, char* out, size_t out_size, uint32_t* state_count);
+
+// Bytes needed by inkwave_to_matrices() for a waveform of `state_count`
+// states. A trailing partial phase is left out. Every layout keeps each
+// phase (or each transition) on whole cache lines so a buffer aligned to
+// INKWAVE_CACHE_LINE keeps every matrix aligned.
+size_t inkwave_matrix_size(const struct inkwave_model* model, uint32_t state_count, int layout);
+
+// Rearrange the unpacked states of a waveform (from inkwave_decode_waveform()
+// or inkwave_query()) into per-phase transition matrices, 16 x 16 at
+// 4 bits per pixel or 32 x 32 at 5, in the given layout.
+// Returns the number of phases or -1 for an unknown layout.
+long inkwave_to_matrices(const struct inkwave_model* model, const char* states, uint32_t state_count, int layout, char* out);
+
+// An update computed by inkwave_simulate(). Frame p, row y starts at
+// out + (p * height + y) * row_bytes and holds the drive value of each
+// pixel, four 2 bit values per byte with the leftmost pixel lowest.
+struct inkwave_sim {
+  uint32_t width;
+  uint32_t height;
+  uint32_t phases; // frames in the update
+  uint32_t row_bytes; // width / 4 rounded up
+  uint32_t frame_rate; // Hz or 0 if the header doesn't say
+  uint32_t duration_ms; // phases at frame_rate or 0 if unknown
+};
+
+// frame rate in Hz from the header's fpl_rate or 0 if unknown
+uint32_t inkwave_frame_rate(const struct waveform_data_header* header);
+
+// Bytes of arena inkwave_simulate() needs for a waveform of `state_count` states.
+size_t inkwave_sim_arena_size(const struct inkwave_model* model, uint32_t state_count);
+
+// Bytes of output inkwave_simulate() writes for a waveform of
+// `state_count` states and a width x height image.
+size_t inkwave_sim_size(const struct inkwave_model* model, uint32_t state_count, uint32_t width, uint32_t height);
+
+// Compute the drive value of every pixel in every phase of an update from
+// `old_img` to `new_img` using a waveform's unpacked states (e.g. from
+// inkwave_query()). Images hold one gray level per byte, row after row,
+// of which only the low 4 (or 5) bits are used. Rows are split over
+// `threads` threads. `out` must have room for inkwave_sim_size() bytes
+// and `arena` for inkwave_sim_arena_size() bytes.
+// Returns 0 and fills in *sim or -1 in which case
+// model->err contains a human readable error message.
+int inkwave_simulate(struct inkwave_model* model, struct inkwave_arena* arena, const char* states, uint32_t state_count, const uint8_t* old_img, const uint8_t* new_img, uint32_t width, uint32_t height, int threads, char* out, struct inkwave_sim* sim);
+
+// Parse and validate a .wrf file held in memory into the same model.
+// Use the same arena size as for the .wbf it was generated from.
+// `data` must remain valid for as long as the model is used.
+// Returns 0 on success or -1 on failure in which case
+// model->err contains a human readable error message.
+int inkwave_parse_wrf(struct inkwave_model* model, struct inkwave_arena* arena, const char* data, size_t size);
+
+// Fill `lut` (256 entries) with the temperature range for each
+// temperature in °C. Range i covers temps[i] <= t < temps[i+1].
+// Temperatures below the first range map to range 0 and
+// temperatures at or above the upper bound of the last range map to
+// the last range, or both to INKWAVE_NO_TEMP_RANGE with
+// INKWAVE_TEMP_STRICT. Parsing fills model->temp_lut with flags 0.
+void inkwave_temp_lut(const struct inkwave_model* model, int flags, uint16_t* lut);
+
+// temperature range to use at `temp` °C (clamp negative readings to 0)
+static inline uint16_t inkwave_temp_range(const struct inkwave_model* model, uint8_t temp) {
+  return model->temp_lut[temp];
+}
+
+// the waveform used for a (mode, temperature range)
+const struct inkwave_waveform* inkwave_get_waveform(const struct inkwave_model* model, uint16_t mode, uint16_t temp_range);
+
+// Unpack a waveform into one state per byte at `out` which must have room
+// for waveform->state_count bytes. Returns the number of states written.
+long inkwave_decode_waveform(const struct inkwave_model* model, const struct inkwave_waveform* waveform, char* out);
+
+// CRC-32 of a waveform as stored in the file, without decoding it.
+// Equal hashes mean equal states for waveforms of the same format,
+// but the same states can be encoded in more than one way in a .wbf.
+uint32_t inkwave_waveform_hash(const struct inkwave_model* model, const struct inkwave_waveform* waveform);
+
+// index in model->waveforms of the waveform starting at `wav_addr`
+// in the input file or -1 if there is none
+long inkwave_find_waveform(const struct inkwave_model* model, uint32_t wav_addr);
+
+// Exact size in bytes of the .wrf file generated from the model.
+size_t inkwave_wrf_size(const struct inkwave_model* model, int flags);
+
+// Generate the .wrf file into `out` which must be
+// exactly inkwave_wrf_size() bytes long.
+int inkwave_build_wrf(struct inkwave_model* model, int flags, char* out, size_t out_size);
+
+// Upper bound of the size of the .wbf file inkwave_build_wbf()
+// generates from the model.
+size_t inkwave_wbf_max_size(const struct inkwave_model* model);
+
+// Bytes of arena inkwave_build_wbf() needs.
+size_t inkwave_wbf_arena_size(const struct inkwave_model* model);
+
+// Encode the model, e.g. parsed from a .wrf, as a .wbf file into `out`
+// which must be at least inkwave_wbf_max_size() bytes long. Each
+// waveform gets the smallest possible run-length encoding, waveforms
+// that encode the same are stored once and all checksums are computed
+// for the new layout. Returns the size of the .wbf file or -1 on
+// failure in which case model->err contains a human readable error message.
+long inkwave_build_wbf(struct inkwave_model* model, struct inkwave_arena* arena, char* out, size_t out_size);
+
+// Size in bytes of the blob inkwave_build_blob() generates.
+size_t inkwave_blob_size(const struct inkwave_model* model);
+
+// Decode every unique waveform (on up to `threads` threads) into a
+// position-independent blob that readers can map and use directly
+// (see struct inkwave_blob) without parsing or copying anything.
+// `out` must be exactly inkwave_blob_size() bytes and should be cache
+// line aligned. The model must be fully parsed, not opened with
+// inkwave_open_wbf(). Returns 0 on success or -1 on failure in which
+// case model->err contains a human readable error message.
+int inkwave_build_blob(struct inkwave_model* model, int threads, char* out, size_t out_size);
+
+// Check that `data` is a complete blob of this version whose offsets
+// all lie within `size` bytes. Returns 0 if so and -1 otherwise. The
+// accessors below don't check anything else.
+int inkwave_blob_check(const char* data, size_t size);
+
+// The states of the waveform for (mode, temperature range) within the
+// blob or NULL if either is out of range.
+const char* inkwave_blob_waveform(const char* data, uint16_t mode, uint16_t temp_range, uint32_t* state_count);
+
+// temperature range to use at `temp` °C, as inkwave_temp_range()
+static inline uint16_t inkwave_blob_temp_range(const char* data, uint8_t temp) {
+  const struct inkwave_blob* blob = (const struct inkwave_blob*) data;
+
+  return ((const uint16_t*) (data + blob->temp_lut))[temp];
+}
+
+// Same as inkwave_build_wrf() but decodes the waveforms on up to
+// `threads` threads. The output is identical for any thread count.
+int inkwave_build_wrf_threads(struct inkwave_model* model, int flags, int threads, char* out, size_t out_size);
+
+// Read the header of a .wbf file from `fd` to start a streaming
+// conversion that keeps at most about `buf_size` bytes of input in
+// memory. The buffer must hold the pointer tables at the start of the
+// file and the largest waveform both encoded and decoded.
+// Returns 0 on success or -1 on failure in which case
+// stream->err contains a human readable error message.
+int inkwave_stream_open(struct inkwave_stream* stream, int fd, size_t buf_size);
+
+// number of bytes of arena needed for inkwave_stream_wrf(),
+// this is all the memory the conversion uses
+size_t inkwave_stream_arena_size(const struct inkwave_stream* stream);
+
+// Read the rest of the .wbf file, verifying it as it arrives, and
+// write the .wrf file to `out_fd` which must be seekable. Waveforms
+// are decoded as soon as they have been read, on a separate thread
+// from the reading. The tables are written last so the output is
+// only usable if this returns 0. The .wrf holds the same data as
+// inkwave_build_wrf() would generate but all tables come first and
+// the waveforms follow in .wbf order. On failure model->err contains
+// a human readable error message. The model can be inspected
+// afterwards but not used to decode waveforms.
+int inkwave_stream_wrf(struct inkwave_stream* stream, struct inkwave_model* model, struct inkwave_arena* arena, int flags, int out_fd);
+
+#endif
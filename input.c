@@ -0,0 +1,120 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "inkwave.h"
+
+// initial buffer size when reading input we can't map or stat
+#define READ_CHUNK (64 * 1024)
+
+// read everything from `fd` into a malloc'ed buffer
+// for input that can't be mapped (pipes, character devices)
+static int read_all(struct inkwave_input* input, int fd, size_t size_hint) {
+  // one more than the expected size so we hit EOF without growing
+  size_t cap = (size_hint) ? size_hint + 1 : READ_CHUNK;
+  size_t len = 0;
+  ssize_t ret;
+  char* buf;
+  char* tmp;
+
+  buf = malloc(cap);
+  if(!buf) {
+    snprintf(input->err, sizeof(input->err), "Failed to allocate %lu bytes of memory: %s", (unsigned long) cap, strerror(errno));
+    return -1;
+  }
+
+  for(;;) {
+    if(len == cap) {
+      cap *= 2;
+      tmp = realloc(buf, cap);
+      if(!tmp) {
+        snprintf(input->err, sizeof(input->err), "Failed to allocate %lu bytes of memory: %s", (unsigned long) cap, strerror(errno));
+        free(buf);
+        return -1;
+      }
+      buf = tmp;
+    }
+
+    ret = read(fd, buf + len, cap - len);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      snprintf(input->err, sizeof(input->err), "Reading file %s failed: %s", input->path, strerror(errno));
+      free(buf);
+      return -1;
+    }
+    if(ret == 0) break;
+
+    len += ret;
+  }
+
+  input->data = buf;
+  input->size = len;
+  input->mapped = 0;
+  return 0;
+}
+
+int inkwave_input_open(struct inkwave_input* input, const char* path) {
+  int fd;
+  int ret;
+  struct stat st;
+  void* map;
+
+  memset(input, 0, sizeof(struct inkwave_input));
+  input->path = path;
+
+  if(strcmp(path, "-") == 0) {
+    fd = STDIN_FILENO;
+  } else {
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+      snprintf(input->err, sizeof(input->err), "Opening file %s failed: %s", path, strerror(errno));
+      return -1;
+    }
+  }
+
+  if(fstat(fd, &st) < 0) {
+    snprintf(input->err, sizeof(input->err), "Error getting file size for %s: %s", path, strerror(errno));
+    ret = -1;
+    goto out;
+  }
+
+  if(S_ISREG(st.st_mode) && st.st_size > 0) {
+    // we read the whole file front to back (checksum) and then
+    // jump around in it, so fault it all in up front. No sequential
+    // hint, which would let pages we come back to be dropped early.
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if(map != MAP_FAILED) {
+      input->data = map;
+      input->size = st.st_size;
+      input->mapped = 1;
+      ret = 0;
+      goto out;
+    }
+  }
+
+  ret = read_all(input, fd, S_ISREG(st.st_mode) ? st.st_size : 0);
+
+ out:
+  if(fd != STDIN_FILENO) {
+    close(fd);
+  }
+  return ret;
+}
+
+void inkwave_input_close(struct inkwave_input* input) {
+  if(!input->data) return;
+
+  if(input->mapped) {
+    munmap(input->data, input->size);
+  } else {
+    free(input->data);
+  }
+  input->data = NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef INKWAVE_INTERNAL_H
+#define INKWAVE_INTERNAL_H
+
+#include <stdint.h>
+
+// Functions shared between the library's source files
+// that are not part of the public API.
+
+// Decode `len` bytes of run-length encoded waveform into one unpacked
+// state per byte at `out`. Returns the number of states written.
+long decode_waveform(const char* waveform, uint32_t len, char* out);
+
+// Number of states decode_waveform() would write.
+long count_waveform_states(const char* waveform, uint32_t len);
+
+struct inkwave_model;
+struct inkwave_arena;
+
+// Format an error message into model->err and return -1.
+int fail(struct inkwave_model* model, const char* fmt, ...);
+
+struct inkwave_waveform;
+
+// Bytes of run-length encoded states in a waveform as stored in a
+// .wbf, or -1 if there are none, with an error in model->err unless
+// `model` is NULL.
+long waveform_payload_len(struct inkwave_model* model, const struct inkwave_waveform* waveform);
+
+// Validate the temperature range table and xwia and index all
+// waveform references of model->header. Only the tables are read,
+// never the waveforms, but bounds are checked against model->size
+// so model->data must hold every table byte even if it holds less
+// than model->size bytes. Fills in everything but state counts.
+int parse_tables(struct inkwave_model* model, struct inkwave_arena* arena);
+
+// Write a .wrf table entry pointing at output position `pos`:
+// 4 byte address followed by 4 bytes of padding
+int put_table_entry(struct inkwave_model* model, char* entry, size_t pos);
+
+// the .wrf block header stores the state count in 16 bits
+#define WRF_MAX_STATES (0xffff)
+
+#define POOL_MAX_THREADS (64)
+
+// Run fn(ctx, job) for every job in [0, count) using up to
+// `threads` threads including the calling one. Returns when all
+// jobs are done. Jobs may run in any order.
+void run_parallel(int threads, uint32_t count, void (*fn)(void* ctx, uint32_t job), void* ctx);
+
+#endif
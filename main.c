@@ -6,20 +6,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
 #include <sys/stat.h>
-#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
-// there probably aren't any displays with more waveforms than this (we hope)
-// (technically the header allows for 256 * 256 waveforms but that's not realistic)
-#define MAX_WAVEFORMS (4096)
+#include "inkwave.h"
+#include "cli.h"
 
-// these are the actual maximums
-#define MAX_MODES (256)
-#define MAX_TEMP_RANGES (256)
-
-// for unknown reasons addresses in the .wrf file 
-// need to be offset by 63 bytes
-#define MYSTERIOUS_OFFSET (63)
+#define STREAM_BUF_DEFAULT (1024 * 1024)
 
 #define MODE_INIT      (0x0)
 #define MODE_DU        (0x1)
@@ -36,12 +33,6 @@
 #define MODE_GL16_INV  (0xB)
 
 
-typedef struct {
-  uint32_t key;
-  const char* val;
-} Pair;
-
-
 Pair update_modes[] = {
   {MODE_INIT, "INIT (panel initialization / clear screen to white)"},
   {MODE_DU, "DU (direct update, gray to black/white transition, 1bpp)"},
@@ -200,7 +191,6 @@ Pair waveform_tuning_biases[] = {
   {0x00, NULL}
 };
 
-int write_table(uint32_t table_addr, uint32_t* addrs, FILE* outfile, uint32_t max);
 
 const char* get_desc(Pair table[], unsigned int key, const char* def) {
   int i = 0;
@@ -217,8 +207,8 @@ const char* get_desc(Pair table[], unsigned int key, const char* def) {
   }
 }
 
-void print_modes(uint8_t mode_count) {
-  uint8_t i;
+void print_modes(uint16_t mode_count) {
+  uint16_t i;
   const char* desc;
 
   printf("Modes in file:\n");
@@ -243,176 +233,7 @@ const char* get_desc_mfg_code(unsigned int mfg_code) {
   return "Unknown code\0";
 }
 
-
-struct waveform_data_header {
-  uint32_t checksum:32; // 0
-  uint32_t filesize:32; // 4
-  uint32_t serial:32; // 8 serial number
-  uint32_t run_type:8; // 12
-  uint32_t fpl_platform:8; // 13
-  uint32_t fpl_lot:16; // 14
-  uint32_t mode_version_or_adhesive_run_num:8; // 16
-  uint32_t waveform_version:8; // 17
-  uint32_t waveform_subversion:8; // 18
-  uint32_t waveform_type:8; // 19
-  uint32_t fpl_size:8; // 20 (aka panel_size)
-  uint32_t mfg_code:8; // 21 (aka amepd_part_number)
-  uint32_t waveform_tuning_bias_or_rev:8; // 22
-  uint32_t fpl_rate:8; // 23 (aka frame_rate)
-  uint32_t unknown0:8;
-  uint32_t vcom_shifted:8;
-  uint32_t unknown1:16;
-  uint32_t xwia:24; // address of extra waveform information
-  uint32_t cs1:8; // checksum 1
-  uint32_t wmta:24;
-  uint32_t fvsn:8;
-  uint32_t luts:8;
-  uint32_t mc:8; // mode count (length of mode table - 1)
-  uint32_t trc:8; // temperature range count (length of temperature table - 1)
-  uint32_t advanced_wfm_flags:8;
-  uint32_t eb:8;
-  uint32_t sb:8;
-  uint32_t reserved0_1:8;
-  uint32_t reserved0_2:8;
-  uint32_t reserved0_3:8;
-  uint32_t reserved0_4:8;
-  uint32_t reserved0_5:8;
-  uint32_t cs2:8; // checksum 2
-}__attribute__((packed));
-
-struct pointer {
-  uint32_t addr:24;
-  uint8_t checksum:8;
-}__attribute__((packed));
-
-struct temp_range {
-  uint8_t from;
-  uint8_t to;
-};
-
-struct packed_state {
-  uint8_t s0:2;
-  uint8_t s1:2;
-  uint8_t s2:2;
-  uint8_t s3:2;
-}__attribute__((packed));
-
-struct unpacked_state {
-  uint8_t s0;
-  uint8_t s1;
-  uint8_t s2;
-  uint8_t s3;
-}__attribute__((packed));
-
-
-uint8_t get_bits_per_pixel(struct waveform_data_header* header) {
-  return ((header->luts & 0xc) == 4) ? 5 : 4;
-}
-
-
-void compute_crc_table(unsigned int* crc_table) {
-   unsigned c;
-   int n, k;
-   for (n = 0; n < 256; n++) {
-      c = (unsigned) n;
-      for (k = 0; k < 8; k++) {
-         if (c & 1) {
-            c = 0xedb88320L ^ (c >> 1);
-         }
-         else {
-            c = c >> 1;
-         }
-      }
-      crc_table[n] = c;
-   }
-}
-
-
-unsigned int update_crc(unsigned int* crc_table, unsigned crc,
-                           unsigned char *buf, int len) {
-
-  char b;
-  unsigned c = crc ^ 0xffffffff;
-  int i;
-  
-  for(i=0; i < len; i++) {
-    if(!buf) {
-      b = 0;
-    } else {
-      b = buf[i];
-    }
-    c = crc_table[(c ^ b) & 0xff] ^ (c >> 8);
-  }
-  
-  return c ^ 0xffffffff;
-}
-
-unsigned crc32(unsigned char *buf, int len) {
-  static unsigned int crc_table[256];
-  
-  compute_crc_table(crc_table);
-  
-  return update_crc(crc_table, 0, buf, len);
-}
-
-// TODO 
-
-int compare_checksum(char* data, struct waveform_data_header* header) {
-  unsigned int crc;
-  unsigned int crc_table[256];
-  compute_crc_table(crc_table);
-  crc = update_crc(crc_table, 0, NULL, 4);
-  crc = update_crc(crc_table, crc, data+4, header->filesize - 4);
-
-  if(crc != header->checksum) {
-    return -1;
-  }
-  return 0;
-}
-  
-
-int bubble_sort(uint32_t* wav_addrs) {
-  uint32_t i;
-  uint32_t j;
-  uint32_t tmp;
-
-  if(!wav_addrs) return 0;
-
-  for(i=0; i < MAX_WAVEFORMS; i++) {
-    if(!wav_addrs[i]) break; // zero value means end of array
-
-    for(j=0; j < MAX_WAVEFORMS; j++) {
-      if(!wav_addrs[j]) break; // zero value means end of array
-
-      if(i == j) continue;
-
-      if((i < j && wav_addrs[i] > wav_addrs[j]) || (i > j && wav_addrs[i] < wav_addrs[j])) {
-        tmp = wav_addrs[i];
-        wav_addrs[i] = wav_addrs[j];
-        wav_addrs[j] = tmp;
-      }
-    }
-  }
-  return i; // return length
-}
-
-int add_addr(uint32_t* addrs, uint32_t addr, uint32_t max) {
-  uint32_t i;
-
-  for(i=0; i < max; i++) {
-    if(addrs[i] == addr) {
-      return 0; // this address was already in the array
-    }
-    if(!addrs[i]) {
-      addrs[i] = addr;
-      return 1; // added
-    }
-  }
-  fprintf(stderr, "Encountered more addresses than our hardcoded max\n");
-  return -1;
-}
-
-void print_header(struct waveform_data_header* header, int is_wbf) {
+void print_header(const struct waveform_data_header* header, int is_wbf) {
   printf("Header info:\n");
   if(is_wbf) {
     printf("  File size (according to header): %d bytes\n", header->filesize);
@@ -464,676 +285,1479 @@ void print_header(struct waveform_data_header* header, int is_wbf) {
   printf("\n");
 }
 
+void print_mode_list(const struct waveform_data_header* header) {
+  if(header->fpl_platform < 3) {
+    printf("Modes: Unknown (no mode version specified)\n");
+  } else {
+    print_modes(header->mc + 1);
+  }
+}
 
-uint32_t get_waveform_length(uint32_t* wav_addrs, uint32_t wav_addr) {
-  uint32_t i;
-
-  for(i=0; i < MAX_WAVEFORMS - 1; i++) {
-    if(wav_addrs[i] == wav_addr) {
-      if(!wav_addrs[i]) return 0;
+void print_temp_range_table(struct inkwave_model* model) {
+  uint16_t i;
 
-      return wav_addrs[i+1] - wav_addr;
-    }
+  printf("Supported temperature ranges:\n");
+  for(i=0; i < model->temp_range_count; i++) {
+    printf("  %u - %u °C\n", model->temps[i], model->temps[i+1]);
   }
-  return 0;
+  printf("\n");
 }
 
-uint16_t parse_waveform(char* data, uint32_t* wav_addrs, uint32_t wav_addr, FILE* outfile) {
-  uint32_t i, j;
-  struct packed_state* s;
-  struct unpacked_state u;
-  uint16_t count;
-  int fc_active;
-  int zero_pad;
-  size_t written;
-  uint16_t state_count = 0;
-  char* waveform = data + wav_addr;
-
-  // TODO
-  // We are cutting off the last two bytes
-  // since we don't know what they are.
-  // See section on unsolved mysteries at the top of this file.
-  uint32_t len = get_waveform_length(wav_addrs, wav_addr) - 2;
-  if(!len) {
-    fprintf(stderr, "Could not find waveform length\n");
-    return -1;
-  }
+void print_xwia(struct inkwave_model* model) {
+  uint8_t i;
+  int non_printables = 0;
 
-  fc_active = 0;
-  zero_pad = 0;
-  i = 0;
-  while(i < len - 1) {
-    // 0xfc is a start and end tag for a section
-    // of one-byte bit-patterns with an assumed count of 1
-    if((uint8_t) waveform[i] == 0xfc) {
-      fc_active = (fc_active) ? 0 : 1;
-      i++;
-      continue;
+  for(i=0; i < model->xwia_len; i++) {
+    if(!isprint(model->xwia[i])){
+      non_printables++;
     }
+  }
 
-    s = (struct packed_state*) waveform + i;
+  printf("Extra Waveform Info (probably waveform's original filename): ");
 
-    if(fc_active) { // 1-byte pattern (count is always 1)
-      count = 1;
-      zero_pad = 1;
-      i++;
-    } else { // 2-byte pattern (second byte is count)
-      if(i >= len - 1) {
-        count = 1;
-      } else {
-        count = (uint8_t) waveform[i + 1] + 1;
-      }
-      zero_pad = 0;
-      i += 2;
+  if(!model->xwia_len) {
+    printf("None");
+  } else if(non_printables) {
+    printf("(%u bytes containing %u unprintable characters)", model->xwia_len, non_printables);
+  } else {
+    for(i=0; i < model->xwia_len; i++) {
+      printf("%c", model->xwia[i]);
     }
+  }
 
-    state_count += count * 4;
-
-    if(outfile) {
+  printf("\n\n");
+}
 
-      u.s0 = s->s0;
-      u.s1 = s->s1;
-      u.s2 = s->s2;
-      u.s3 = s->s3;
+void print_waveforms(struct inkwave_model* model) {
+  uint16_t i, j;
 
-      for(j=0; j < count; j++) {
+  printf("Modes: \n");
+  for(i=0; i < model->mode_count; i++) {
+    printf("  Checking mode %2u: Passed\n", i);
+    printf("    Temperature ranges: \n");
 
-        written = fwrite(&u, 1, sizeof(u), outfile);
-        if(written != sizeof(u)) {
-          fprintf(stderr, "Error writing waveform to output file: %s\n", strerror(errno));
-          return -1;
-        }
-      }
+    for(j=0; j < model->temp_range_count; j++) {
+      printf("      Checking range %2u: %4u phases\n", j, inkwave_get_waveform(model, i, j)->state_count / inkwave_phase_states(model->header));
     }
+    printf("\n");
   }
-
-  return state_count;
 }
 
-int parse_temp_ranges(struct waveform_data_header* header, char* data, char* tr_start, uint8_t tr_count, uint32_t* wav_addrs, int first_pass, FILE* outfile, int do_print) {
-  struct pointer* tr;
-  uint8_t checksum;
-  uint8_t i;
-  uint16_t state_count;
-  size_t written;
-  long ftable;
-  long fprev;
-  long fcur;
-  uint32_t tr_addrs[256]; // temperature range addresses for output file
-  uint32_t tr_table_addr; // temperature range table output start address
+// Build the .wrf into `out`, which is timed as decoding
+// rather than as part of the write around it.
+static int build_wrf(struct inkwave_model* model, int flags, int threads, char* out, size_t size) {
+  int ret;
 
-  if(!tr_count) {
-    return 0;
-  }
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_WRITE);
+  ret = inkwave_build_wrf_threads(model, flags, threads, out, size);
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_WRITE);
 
-  memset(tr_addrs, 0, sizeof(tr_addrs));
+  return ret;
+}
 
-  if(do_print) {
-    printf("    Temperature ranges: \n");
-  }
+// Generate the .wrf file in memory and write it out in one go.
+// Regular files are allocated up front and written through a mapping,
+// anything else (stdout, pipes, devices) gets a single write() of a buffer.
+// On failure a human readable error message is left in `err` and a
+// partially written regular file is removed, as in stream_wrf().
+int write_wrf(struct inkwave_model* model, int flags, int threads, const char* path, char* err) {
+  int fd;
+  int is_reg = 0;
+  int ret = -1;
+  size_t size;
+  char* out = MAP_FAILED;
+  char* buf = NULL;
+  size_t done;
+  ssize_t written;
+  struct stat st;
+
+  size = inkwave_wrf_size(model, flags);
 
+  inkwave_stats_begin(model->stats, INKWAVE_STAGE_WRITE);
 
-  if(outfile) {
-    ftable = ftell(outfile);
-    if(ftable < 0) {
-      fprintf(stderr, "Error getting position in file: %s\n", strerror(errno));
+  if(strcmp(path, "-") == 0) {
+    fd = STDOUT_FILENO;
+  } else {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", path, strerror(errno));
+      inkwave_stats_end(model->stats, INKWAVE_STAGE_WRITE);
       return -1;
     }
-    if(fseek(outfile, (header->trc + 1) * 8, SEEK_CUR) < 0) {
-      fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-      return -1;      
+
+    if(fstat(fd, &st) < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Error getting file info for %s: %s", path, strerror(errno));
+      goto out;
+    }
+
+    is_reg = S_ISREG(st.st_mode);
+
+    // Storing into a sparse file through a mapping raises SIGBUS when
+    // the disk fills up, so only blocks that are really allocated are
+    // mapped. Otherwise write() reports the error.
+    if(is_reg && size && posix_fallocate(fd, 0, size) == 0) {
+      out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
   }
 
-  for(i=0; i < tr_count; i++) {
-    if(do_print) {
-      printf("      Checking range %2u: ", i);
+  if(out != MAP_FAILED) {
+    if(build_wrf(model, flags, threads, out, size) < 0) {
+      strcpy(err, model->err);
+      goto out;
     }
-    tr = (struct pointer*) tr_start;
-    checksum = tr_start[0] + tr_start[1] + tr_start[2];
-    if(checksum != tr->checksum) {
-      if(do_print) {
-      printf("Failed\n");
-      }
-      return -1;
+  } else {
+    buf = malloc(size);
+    if(!buf) {
+      snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate %lu bytes of memory: %s", (unsigned long) size, strerror(errno));
+      goto out;
+    }
+    if(build_wrf(model, flags, threads, buf, size) < 0) {
+      strcpy(err, model->err);
+      goto out;
     }
 
-    if(first_pass) {
-      if(add_addr(wav_addrs, tr->addr, MAX_WAVEFORMS) < 0) {
-        return -1;
+    // pipes may accept less than everything at once
+    for(done=0; done < size; done += written) {
+      written = write(fd, buf + done, size - done);
+      if(written < 0) {
+        if(errno == EINTR) {
+          written = 0;
+          continue;
+        }
+        snprintf(err, INKWAVE_ERR_LEN, "Error writing output file: %s", strerror(errno));
+        goto out;
       }
-    } else {
-
-      if(outfile) {
+    }
+  }
 
-        fprev = ftell(outfile); // save position to use for writing phase count
-        if(fprev < 0) {
-          fprintf(stderr, "Error getting position in file: %s\n", strerror(errno));
-          return -1;
-        }
+  ret = 0;
 
-        if(add_addr(tr_addrs, fprev - MYSTERIOUS_OFFSET, MAX_TEMP_RANGES) < 0) {
-          return -1;
-        }
+ out:
+  if(out != MAP_FAILED) {
+    munmap(out, size);
+  }
+  free(buf);
+  if(fd != STDOUT_FILENO && close(fd) < 0 && ret == 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing output file failed: %s", strerror(errno));
+    ret = -1;
+  }
+  if(ret < 0 && is_reg) {
+    unlink(path);
+  }
+  inkwave_stats_end(model->stats, INKWAVE_STAGE_WRITE);
+  return ret;
+}
 
-        if(fseek(outfile, 8, SEEK_CUR) < 0) {
-          fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-          return -1;
-        }
-      }
-      state_count = parse_waveform(data, wav_addrs, tr->addr, outfile);
-      if(state_count < 0) {
-        return -1;
-      }
+// Convert while reading the input front to back, see inkwave_stream_wrf().
+// A partially written output file is removed on failure.
+int stream_wrf(const char* in_path, size_t buf_size, int flags, const char* out_path, char* err) {
+  struct inkwave_stream stream;
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+  char* arena_buf = NULL;
+  int in_fd;
+  int out_fd = -1;
+  int ret = -1;
+
+  if(strcmp(in_path, "-") == 0) {
+    in_fd = STDIN_FILENO;
+  } else {
+    in_fd = open(in_path, O_RDONLY);
+    if(in_fd < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Opening file %s failed: %s", in_path, strerror(errno));
+      return -1;
+    }
+  }
 
-      if(do_print) {
-        printf("%4u phases\n", state_count / 256);
-      }
+  if(inkwave_stream_open(&stream, in_fd, buf_size) < 0) {
+    strcpy(err, stream.err);
+    goto out;
+  }
 
-      if(outfile) {
-        fcur = ftell(outfile); // save current position in file
-        if(fcur < 0) {
-          fprintf(stderr, "Error getting position in file: %s\n", strerror(errno));
-          return -1;
-        }
-        if(fseek(outfile, fprev, SEEK_SET) < 0) {
-          fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-          return -1;
-        }
+  arena_buf = malloc(inkwave_stream_arena_size(&stream));
+  if(!arena_buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  inkwave_arena_init(&arena, arena_buf, inkwave_stream_arena_size(&stream));
 
-        state_count = htons(state_count);
-        // write state count
-        written = fwrite(&state_count, sizeof(state_count), 1, outfile);
-        if(written != 1) {
-          fprintf(stderr, "Error writing state count to output file: %s\n", strerror(errno));
-          return -1;
-        }
+  if(strcmp(out_path, "-") == 0) {
+    out_fd = STDOUT_FILENO;
+  } else {
+    out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(out_fd < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", out_path, strerror(errno));
+      goto out;
+    }
+  }
 
-        // restore file position to end of previously written data
-        if(fseek(outfile, fcur, SEEK_SET) < 0) {
-          fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-          return -1;
-        }
-      }
+  if(inkwave_stream_wrf(&stream, &model, &arena, flags, out_fd) < 0) {
+    strcpy(err, model.err);
+    if(out_fd != STDOUT_FILENO) {
+      unlink(out_path);
     }
+    goto out;
+  }
 
-    tr_start += 4;
+  ret = 0;
+
+ out:
+  if(out_fd >= 0 && out_fd != STDOUT_FILENO && close(out_fd) < 0 && ret == 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing output file failed: %s", strerror(errno));
+    ret = -1;
   }
-  if(do_print) {
-    printf("\n");
+  if(in_fd != STDIN_FILENO) {
+    close(in_fd);
   }
+  free(arena_buf);
+  return ret;
+}
 
-  if(outfile) {
-    if(write_table(ftable, tr_addrs, outfile, MAX_TEMP_RANGES) < 0) {
-      fprintf(stderr, "Error writing temperature range table\n");
-      return -1;
-    }
+// Encode the model as a .wbf file, see inkwave_build_wbf().
+int write_wbf(struct inkwave_model* model, const char* path, char* err) {
+  struct inkwave_arena arena;
+  char* arena_buf;
+  size_t max_size;
+  char* buf;
+  long size;
+  FILE* fd;
+  int ret = -1;
 
+  max_size = inkwave_wbf_max_size(model);
+  arena_buf = malloc(inkwave_wbf_arena_size(model));
+  buf = malloc(max_size);
+  if(!arena_buf || !buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
   }
+  inkwave_arena_init(&arena, arena_buf, inkwave_wbf_arena_size(model));
 
-  return 0;
-}
+  size = inkwave_build_wbf(model, &arena, buf, max_size);
+  if(size < 0) {
+    strcpy(err, model->err);
+    goto out;
+  }
 
+  fd = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+  if(!fd) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", path, strerror(errno));
+    goto out;
+  }
 
-int parse_modes(struct waveform_data_header* header, char* data, char* mode_start, uint8_t mode_count, uint8_t temp_range_count, uint32_t* wav_addrs, int first_pass, FILE* outfile, int do_print) {
-  struct pointer* mode;
-  uint8_t checksum;
-  uint8_t i;
-  long pos;
-  uint32_t mode_addrs[256]; // mode addresses for output file
-  uint32_t mode_table_addr; // mode table output start address
+  if(fwrite(buf, size, 1, fd) != 1) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error writing %s: %s", path, strerror(errno));
+    if(fd != stdout) fclose(fd);
+    goto out;
+  }
 
-  if(!mode_count) {
-    return 0;
+  if(fd != stdout && fclose(fd) != 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing %s failed: %s", path, strerror(errno));
+    goto out;
   }
 
-  memset(mode_addrs, 0, sizeof(mode_addrs));
+  ret = 0;
 
-  if(do_print) {
-    printf("Modes: \n");
+ out:
+  free(arena_buf);
+  free(buf);
+  return ret;
+}
+
+// Write the decoded waveforms as a blob for mapping, see
+// inkwave_build_blob(). A file is written under a temporary name and
+// renamed into place so readers that have the old one mapped keep it.
+int write_blob(struct inkwave_model* model, int threads, const char* path, char* err) {
+  char tmp[4096];
+  char* buf;
+  size_t size, done;
+  ssize_t written;
+  struct stat st;
+  mode_t mode;
+  int fd = STDOUT_FILENO;
+  int ret = -1;
+
+  size = inkwave_blob_size(model);
+  buf = aligned_alloc(INKWAVE_CACHE_LINE, (size + INKWAVE_CACHE_LINE - 1) & ~((size_t) INKWAVE_CACHE_LINE - 1));
+  if(!buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate %lu bytes of memory: %s", (unsigned long) size, strerror(errno));
+    return -1;
+  }
+  if(inkwave_build_blob(model, threads, buf, size) < 0) {
+    strcpy(err, model->err);
+    goto out;
   }
 
-  for(i=0; i < mode_count; i++) {
-    if(do_print) {
-      printf("  Checking mode %2u: ", i);
+  if(strcmp(path, "-") != 0) {
+    if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int) sizeof(tmp)) {
+      snprintf(err, INKWAVE_ERR_LEN, "Output path too long: %s", path);
+      goto out;
     }
-    mode = (struct pointer*) mode_start;
-    checksum = mode_start[0] + mode_start[1] + mode_start[2];
-    if(checksum != mode->checksum) {
-      if(do_print) {
-        printf("Failed\n");
-      }
-      return -1;
+    fd = mkstemp(tmp);
+    if(fd < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Creating temporary file for %s failed: %s", path, strerror(errno));
+      goto out;
     }
 
-    if(outfile) {
-
-      pos = ftell(outfile) - MYSTERIOUS_OFFSET;
-      if(pos < 0) {
-        fprintf(stderr, "Error getting position in file: %s\n", strerror(errno));
-        return -1;
-      }
+    // mkstemp() creates files as 0600, give the blob the mode
+    // of the file it replaces or open() would have used
+    if(stat(path, &st) == 0) {
+      mode = st.st_mode & 07777;
+    } else {
+      mode = umask(0);
+      umask(mode);
+      mode = 0666 & ~mode;
+    }
+    if(fchmod(fd, mode) < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Setting the mode of %s failed: %s", path, strerror(errno));
+      goto out;
+    }
+  }
 
-      if(add_addr(mode_addrs, pos, MAX_MODES) < 0) {
-        return -1;
+  for(done=0; done < size; done += written) {
+    written = write(fd, buf + done, size - done);
+    if(written < 0) {
+      if(errno == EINTR) {
+        written = 0;
+        continue;
       }
+      snprintf(err, INKWAVE_ERR_LEN, "Error writing %s: %s", path, strerror(errno));
+      goto out;
     }
+  }
 
-    if(do_print) {
-      printf("Passed\n");
+  if(fd != STDOUT_FILENO) {
+    if(close(fd) < 0) {
+      fd = STDOUT_FILENO;
+      snprintf(err, INKWAVE_ERR_LEN, "Closing %s failed: %s", path, strerror(errno));
+      goto out;
     }
-    if(parse_temp_ranges(header, data, data + mode->addr, temp_range_count, wav_addrs, first_pass, outfile, do_print) < 0) {
-      return -1;
+    fd = STDOUT_FILENO;
+    if(rename(tmp, path) < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Renaming temporary file to %s failed: %s", path, strerror(errno));
+      unlink(tmp);
+      goto out;
     }
-    
-    mode_start += 4;
   }
 
+  ret = 0;
 
-  if(outfile) {
-    // the + 2 is because there is one more temperature range than the
-    // count in header->trc and then because these are ranges there is one
-    // more temperature than the number of ranges
-    mode_table_addr = sizeof(struct waveform_data_header) + header->trc + 2;
+ out:
+  if(fd != STDOUT_FILENO) {
+    close(fd);
+    unlink(tmp);
+  }
+  free(buf);
+  return ret;
+}
 
-    if(write_table(mode_table_addr, mode_addrs, outfile, MAX_MODES) < 0) {
-      fprintf(stderr, "Error writing mode table\n");
-      return -1;
-    }
+// Write model->temp_lut as 256 little-endian 16 bit temperature
+// range indices, one per °C, with 0xffff meaning none.
+int write_temp_lut(const struct inkwave_model* model, const char* path, char* err) {
+  uint8_t buf[2 * 256];
+  FILE* fd;
+  int i;
+
+  for(i=0; i < 256; i++) {
+    buf[2 * i] = model->temp_lut[i] & 0xff;
+    buf[2 * i + 1] = model->temp_lut[i] >> 8;
   }
 
-  return 0;
-}
+  fd = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+  if(!fd) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", path, strerror(errno));
+    return -1;
+  }
 
-int check_xwia(char* xwia, int do_print) {
-  uint8_t xwia_len;
-  uint8_t i;
-  uint8_t checksum;
-  int non_printables = 0;
+  if(fwrite(buf, sizeof(buf), 1, fd) != 1) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error writing %s: %s", path, strerror(errno));
+    if(fd != stdout) fclose(fd);
+    return -1;
+  }
+
+  if(fd != stdout && fclose(fd) != 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing %s failed: %s", path, strerror(errno));
+    return -1;
+  }
 
-  xwia_len = *(xwia);
-  xwia = xwia + 1;
-  checksum = xwia_len;
+  return 0;
+}
 
+// Decode the waveform for (mode, temperature range) and rearrange it
+// into transition matrices, see inkwave_to_matrices(). The result is
+// cache line aligned and must be freed. Sets *phases and *size.
+static char* get_matrices(const struct inkwave_model* model, uint16_t mode, uint16_t temp_range, int layout, long* phases, size_t* size, char* err) {
+  const struct inkwave_waveform* waveform;
+  char* states;
+  char* matrices;
+
+  if(mode >= model->mode_count || temp_range >= model->temp_range_count) {
+    snprintf(err, INKWAVE_ERR_LEN, "No waveform for mode %u temperature range %u", mode, temp_range);
+    return NULL;
+  }
+  waveform = inkwave_get_waveform(model, mode, temp_range);
+
+  states = malloc(waveform->state_count);
+  *size = inkwave_matrix_size(model, waveform->state_count, layout);
+  matrices = aligned_alloc(INKWAVE_CACHE_LINE, *size + INKWAVE_CACHE_LINE);
+  if(!states || !matrices) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    free(states);
+    free(matrices);
+    return NULL;
+  }
+
+  inkwave_decode_waveform(model, waveform, states);
+  *phases = inkwave_to_matrices(model, states, waveform->state_count, layout, matrices);
+  free(states);
+  return matrices;
+}
 
-  for(i=0; i < xwia_len; i++) {
-    if(!isprint(xwia[i])){
-      non_printables++;
-    }
-    checksum += xwia[i];
+// Print the [phase][old][new] matrices of one waveform.
+int print_matrices(const struct inkwave_model* model, uint16_t mode, uint16_t temp_range, char* err) {
+  uint32_t levels = (get_bits_per_pixel(model->header) == 5) ? 32 : 16;
+  char* matrices;
+  const char* m;
+  size_t size;
+  long phases, p;
+  uint32_t old, new;
+
+  matrices = get_matrices(model, mode, temp_range, INKWAVE_MATRIX_PHASE_MAJOR, &phases, &size, err);
+  if(!matrices) {
+    return -1;
   }
 
-  if(do_print) {
-    
-    printf("Extra Waveform Info (probably waveform's original filename): ");
+  printf("Mode %u, temperature range %u: %ld phases\n", mode, temp_range, phases);
+  printf("Rows are old gray levels, columns new gray levels\n\n");
 
-    if(!xwia_len) {
-      printf("None");
-    } else if(non_printables) {
-      printf("(%u bytes containing %u unprintable characters)", xwia_len, non_printables);
-    } else {
-      for(i=0; i < xwia_len; i++) {
-        printf("%c", xwia[i]);
+  m = matrices;
+  for(p=0; p < phases; p++) {
+    printf("  Phase %ld:\n", p);
+    for(old=0; old < levels; old++) {
+      printf("    %2u:", old);
+      for(new=0; new < levels; new++) {
+        printf(" %u", (uint8_t) *m++);
       }
+      printf("\n");
     }
-    
-    printf("\n\n");
+    printf("\n");
   }
 
-  if(checksum != (uint8_t) *(xwia + xwia_len)) {
-    return -1;
-  }
+  free(matrices);
   return 0;
 }
 
-int parse_temp_range_table(char* table, uint8_t range_count, FILE* outfile, int do_print) {
-  uint8_t i;
-  uint8_t checksum;
-  struct temp_range range;
-  size_t written;
+// Write the matrices of one waveform in the given layout, see
+// inkwave_to_matrices(). Use - for stdout.
+int write_matrices(const struct inkwave_model* model, uint16_t mode, uint16_t temp_range, int layout, const char* path, char* err) {
+  char* matrices;
+  long phases;
+  size_t size;
+  FILE* fd;
+  int ret = -1;
+
+  matrices = get_matrices(model, mode, temp_range, layout, &phases, &size, err);
+  if(!matrices) {
+    return -1;
+  }
 
-  if(!range_count) {
-    return 0;
+  fd = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+  if(!fd) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", path, strerror(errno));
+    goto out;
   }
 
-  if(do_print) {
-    printf("Supported temperature ranges:\n");
+  if(size && fwrite(matrices, size, 1, fd) != 1) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error writing %s: %s", path, strerror(errno));
+    if(fd != stdout) fclose(fd);
+    goto out;
   }
 
-  checksum = 0;
-  for(i=0; i < range_count; i++) {
-    range.from = (uint8_t) table[i];
-    range.to = (uint8_t) table[i+1];
-    if(do_print) {
-      printf("  %u - %u °C\n", range.from, range.to);
+  if(fd != stdout && fclose(fd) != 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Closing %s failed: %s", path, strerror(errno));
+    goto out;
+  }
+
+  ret = 0;
+
+ out:
+  free(matrices);
+  return ret;
+}
+
+// skip whitespace and # comments between PGM header fields
+static int pgm_skip(FILE* fd) {
+  int c;
+
+  while((c = fgetc(fd)) != EOF) {
+    if(c == '#') {
+      while((c = fgetc(fd)) != EOF && c != '\n');
+    } else if(!isspace(c)) {
+      ungetc(c, fd);
+      return 0;
     }
-    checksum += range.from;
   }
-  checksum += range.to;
- 
-  if(checksum != (uint8_t) table[range_count+1]) {
-    return -1;
+  return -1;
+}
+
+// Read a binary (P5) 8 bit PGM image scaled to `levels` gray levels,
+// one per byte. Returns a malloc'ed buffer or NULL.
+static uint8_t* read_pgm(const char* path, uint32_t levels, uint32_t* width, uint32_t* height, char* err) {
+  unsigned int w, h, maxval;
+  uint8_t* img = NULL;
+  size_t size, i;
+  FILE* fd;
+
+  fd = fopen(path, "rb");
+  if(!fd) {
+    snprintf(err, INKWAVE_ERR_LEN, "Opening file %s failed: %s", path, strerror(errno));
+    return NULL;
   }
 
-  if(outfile) {
-    written = fwrite(table, 1, range_count+1, outfile);
-    if(written != range_count+1) {
-      fprintf(stderr, "Error writing temperature range table to output file: %s\n", strerror(errno));
-      return -1;
-    }
+  if(fgetc(fd) != 'P' || fgetc(fd) != '5'
+     || pgm_skip(fd) < 0 || fscanf(fd, "%u", &w) != 1
+     || pgm_skip(fd) < 0 || fscanf(fd, "%u", &h) != 1
+     || pgm_skip(fd) < 0 || fscanf(fd, "%u", &maxval) != 1
+     || !isspace(fgetc(fd))) {
+    snprintf(err, INKWAVE_ERR_LEN, "%s is not a binary PGM image", path);
+    goto out;
+  }
+  if(!maxval || maxval > 255) {
+    snprintf(err, INKWAVE_ERR_LEN, "%s: only 8 bit PGM images are supported", path);
+    goto out;
   }
 
-  if(do_print) {
-    printf("\n");
+  size = (size_t) w * h;
+  img = malloc(size ? size : 1);
+  if(!img) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  if(fread(img, 1, size, fd) != size) {
+    snprintf(err, INKWAVE_ERR_LEN, "%s: image data truncated", path);
+    free(img);
+    img = NULL;
+    goto out;
   }
 
-  return 0;
-}
+  for(i=0; i < size; i++) {
+    img[i] = ((img[i] > maxval ? maxval : img[i]) * (levels - 1) + maxval / 2) / maxval;
+  }
+  *width = w;
+  *height = h;
 
-int write_table(uint32_t table_addr, uint32_t* addrs, FILE* outfile, uint32_t max) {
-  int i;
-  size_t written;
-  uint32_t addr;
-  long prev;
+ out:
+  fclose(fd);
+  return img;
+}
 
-  prev = ftell(outfile);
-  if(prev < 0) {
+// Simulate an update from the image at `old_path` to the one at
+// `new_path` with the waveform for `mode` at `temp` °C and print a
+// summary. With `out_path` the frames are written there too.
+int simulate(struct inkwave_model* model, uint16_t mode, uint8_t temp, const char* old_path, const char* new_path, int threads, const char* out_path, char* err) {
+  uint32_t levels = (get_bits_per_pixel(model->header) == 5) ? 32 : 16;
+  uint16_t temp_range = inkwave_temp_range(model, temp);
+  uint8_t* old_img = NULL;
+  uint8_t* new_img = NULL;
+  char* arena_buf = NULL;
+  char* out = NULL;
+  struct inkwave_arena arena;
+  struct inkwave_sim sim;
+  struct timespec start, end;
+  uint32_t width, height, new_width, new_height;
+  const struct inkwave_waveform* waveform;
+  uint32_t state_count;
+  char* states = NULL;
+  size_t size;
+  FILE* fd;
+  int ret = -1;
+
+  if(temp_range == INKWAVE_NO_TEMP_RANGE) {
+    snprintf(err, INKWAVE_ERR_LEN, "No temperature range for %u °C", temp);
     return -1;
   }
 
-  if(fseek(outfile, table_addr, SEEK_SET) < 0) {
-    fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
+  if(mode >= model->mode_count) {
+    snprintf(err, INKWAVE_ERR_LEN, "Mode %u out of range (%u modes)", mode, model->mode_count);
     return -1;
   }
+  waveform = inkwave_get_waveform(model, mode, temp_range);
+  state_count = waveform->state_count;
 
-  for(i=0; i < max; i++) {
-    if(!addrs[i]) break;
+  old_img = read_pgm(old_path, levels, &width, &height, err);
+  if(!old_img) {
+    goto out;
+  }
+  new_img = read_pgm(new_path, levels, &new_width, &new_height, err);
+  if(!new_img) {
+    goto out;
+  }
+  if(width != new_width || height != new_height) {
+    snprintf(err, INKWAVE_ERR_LEN, "Image sizes differ: %ux%u and %ux%u", width, height, new_width, new_height);
+    goto out;
+  }
 
-    addr = addrs[i];
+  size = inkwave_sim_arena_size(model, state_count);
+  states = malloc(state_count + 1);
+  arena_buf = malloc(size);
+  out = malloc(inkwave_sim_size(model, state_count, width, height) + 1);
+  if(!states || !arena_buf || !out) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  inkwave_arena_init(&arena, arena_buf, size);
+  inkwave_decode_waveform(model, waveform, states);
 
-    written = fwrite(&addr, 1, sizeof(uint32_t), outfile);
-    if(written != sizeof(uint32_t)) {
-      fprintf(stderr, "Error writing address table to output file: %s\n", strerror(errno));
-      return -1;
-    }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if(inkwave_simulate(model, &arena, states, state_count, old_img, new_img, width, height, threads, out, &sim) < 0) {
+    strcpy(err, model->err);
+    goto out;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-    if(fseek(outfile, 4, SEEK_CUR) < 0) {
-      fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-      return -1;
+  printf("Mode %u, %u °C (temperature range %u), %ux%u pixels\n", mode, temp, temp_range, width, height);
+  printf("  Phases: %u\n", sim.phases);
+  if(sim.frame_rate) {
+    printf("  Update duration: %u ms at %u Hz\n", sim.duration_ms, sim.frame_rate);
+  } else {
+    printf("  Update duration: unknown frame rate (fpl_rate 0x%x)\n", model->header->fpl_rate);
+  }
+  printf("  Simulated in %.3f ms using %d threads\n",
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, threads);
+
+  if(out_path) {
+    fd = (strcmp(out_path, "-") == 0) ? stdout : fopen(out_path, "wb");
+    if(!fd) {
+      snprintf(err, INKWAVE_ERR_LEN, "Opening file %s for writing failed: %s", out_path, strerror(errno));
+      goto out;
+    }
+    size = inkwave_sim_size(model, state_count, width, height);
+    if(size && fwrite(out, size, 1, fd) != 1) {
+      snprintf(err, INKWAVE_ERR_LEN, "Error writing %s: %s", out_path, strerror(errno));
+      if(fd != stdout) fclose(fd);
+      goto out;
+    }
+    if(fd != stdout && fclose(fd) != 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Closing %s failed: %s", out_path, strerror(errno));
+      goto out;
     }
   }
 
-  if(fseek(outfile, prev, SEEK_SET) < 0) {
-    fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
+  ret = 0;
+
+ out:
+  free(states);
+  free(old_img);
+  free(new_img);
+  free(arena_buf);
+  free(out);
+  return ret;
+}
+
+// matrix layout by name or -1
+static int parse_layout(const char* str) {
+  if(strcmp(str, "phase") == 0) {
+    return INKWAVE_MATRIX_PHASE_MAJOR;
+  } else if(strcmp(str, "transition") == 0) {
+    return INKWAVE_MATRIX_TRANSITION_MAJOR;
+  } else if(strcmp(str, "packed") == 0) {
+    return INKWAVE_MATRIX_PACKED;
+  }
+  return -1;
+}
+
+// parse a byte count with an optional k, M or G suffix
+static size_t parse_size(const char* str) {
+  char* end;
+  unsigned long long size = strtoull(str, &end, 10);
+
+  switch(*end) {
+  case 'k': case 'K': size <<= 10; break;
+  case 'm': case 'M': size <<= 20; break;
+  case 'g': case 'G': size <<= 30; break;
+  }
+
+  return size;
+}
+
+// 1 for .wbf, 0 for .wrf by the file name unless forced with -f,
+// -1 after printing why if neither
+static int input_format(const char* path, const char* force_input) {
+  if(force_input) {
+    if(strncmp(force_input, "wbf", 3) == 0) {
+      return 1;
+    } else if(strncmp(force_input, "wrf", 3) == 0) {
+      return 0;
+    }
+    fprintf(stderr, "Only wbf and wrf format is supported\n");
     return -1;
-  }  
+  }
 
-  return 0;
+  if(strlen(path) >= 4) {
+    if(strncmp(path + strlen(path) - 4, ".wbf", 4) == 0) {
+      return 1;
+    } else if(strncmp(path + strlen(path) - 4, ".wrf", 4) == 0) {
+      return 0;
+    }
+  }
+  fprintf(stderr, "%s has neither .wbf or .wrf extension\n", path);
+  fprintf(stderr, "Consider using `-f` to bypass file format detection\n");
+  return -1;
+}
+
+// --stats output formats
+#define STATS_OFF  (0)
+#define STATS_TEXT (1)
+#define STATS_JSON (2)
+
+// I/O done by the process so far, see proc(5). Memory mapped input and
+// output don't show up here, only read() and write() calls.
+struct proc_io {
+  uint64_t rchar;
+  uint64_t wchar;
+  uint64_t syscr;
+  uint64_t syscw;
+};
+
+static const char* stage_names[INKWAVE_STAGES] = {
+  "read",
+  "checksum",
+  "temps",
+  "modes",
+  "sort",
+  "count",
+  "decode",
+  "write",
+  "stream"
+};
+
+static const char* counter_names[INKWAVE_COUNTERS] = {
+  "cycles",
+  "instructions",
+  "cache_misses"
+};
+
+static uint64_t wall_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int write_header(FILE* outfile, struct waveform_data_header* header) {
-  size_t written;
+// all zero where /proc is not available
+static void read_proc_io(struct proc_io* io) {
+  char name[32];
+  unsigned long long val;
+  FILE* fd;
+
+  memset(io, 0, sizeof(struct proc_io));
+  fd = fopen("/proc/self/io", "r");
+  if(!fd) {
+    return;
+  }
+  while(fscanf(fd, "%31[^:]: %llu\n", name, &val) == 2) {
+    if(strcmp(name, "rchar") == 0) {
+      io->rchar = val;
+    } else if(strcmp(name, "wchar") == 0) {
+      io->wchar = val;
+    } else if(strcmp(name, "syscr") == 0) {
+      io->syscr = val;
+    } else if(strcmp(name, "syscw") == 0) {
+      io->syscw = val;
+    }
+  }
+  fclose(fd);
+}
 
-  written = fwrite(header, 1, sizeof(struct waveform_data_header), outfile);
-  if(written < sizeof(struct waveform_data_header)) {
+static int parse_stats(const char* str, int* counters) {
+  const char* comma = strchr(str, ',');
+  size_t len = (comma) ? (size_t) (comma - str) : strlen(str);
+  int format;
+
+  if(len == 4 && strncmp(str, "text", 4) == 0) {
+    format = STATS_TEXT;
+  } else if(len == 4 && strncmp(str, "json", 4) == 0) {
+    format = STATS_JSON;
+  } else {
     return -1;
   }
+  if(comma) {
+    if(strcmp(comma + 1, "counters") != 0) {
+      return -1;
+    }
+    *counters = 1;
+  }
+  return format;
+}
 
-  return 0;
+// Report to stderr. Decoding runs inside the write stage when
+// converting so its time is taken out of the write stage.
+static void print_stats(int format, struct inkwave_stats* stats, uint64_t total_ns, const struct proc_io* start, size_t in_bytes, const char* out_path) {
+  struct inkwave_stage_stats stages[INKWAVE_STAGES];
+  struct inkwave_stage_stats* s;
+  struct proc_io end;
+  struct rusage usage;
+  struct stat st;
+  uint64_t out_bytes = 0;
+  int i, j, first = 1;
+
+  read_proc_io(&end);
+  if(getrusage(RUSAGE_SELF, &usage) < 0) {
+    usage.ru_maxrss = 0;
+  }
+  if(out_path && strcmp(out_path, "-") != 0 && stat(out_path, &st) == 0) {
+    out_bytes = st.st_size;
+  }
+
+  memcpy(stages, stats->stages, sizeof(stages));
+
+  if(format == STATS_JSON) {
+    fprintf(stderr, "{\"stages\": {");
+    for(i=0; i < INKWAVE_STAGES; i++) {
+      s = &stages[i];
+      if(!s->runs) continue;
+      fprintf(stderr, "%s\"%s\": {\"runs\": %u, \"wall_ns\": %llu, \"cpu_ns\": %llu",
+              (first) ? "" : ", ", stage_names[i], s->runs,
+              (unsigned long long) s->wall_ns, (unsigned long long) s->cpu_ns);
+      for(j=0; stats->counters && j < INKWAVE_COUNTERS; j++) {
+        fprintf(stderr, ", \"%s\": %llu", counter_names[j], (unsigned long long) s->counters[j]);
+      }
+      fprintf(stderr, "}");
+      first = 0;
+    }
+    fprintf(stderr, "}, \"total_wall_ns\": %llu", (unsigned long long) total_ns);
+    fprintf(stderr, ", \"input_bytes\": %llu, \"output_bytes\": %llu",
+            (unsigned long long) in_bytes, (unsigned long long) out_bytes);
+    fprintf(stderr, ", \"read_bytes\": %llu, \"written_bytes\": %llu",
+            (unsigned long long) (end.rchar - start->rchar), (unsigned long long) (end.wchar - start->wchar));
+    fprintf(stderr, ", \"read_calls\": %llu, \"write_calls\": %llu",
+            (unsigned long long) (end.syscr - start->syscr), (unsigned long long) (end.syscw - start->syscw));
+    fprintf(stderr, ", \"waveforms_decoded\": %u, \"waveforms_unique\": %u",
+            stats->waveforms_decoded, stats->waveforms_unique);
+    fprintf(stderr, ", \"peak_rss_kb\": %ld}\n", usage.ru_maxrss);
+    return;
+  }
+
+  fprintf(stderr, "%-10s %5s %12s %12s", "stage", "runs", "wall_us", "cpu_us");
+  for(j=0; stats->counters && j < INKWAVE_COUNTERS; j++) {
+    fprintf(stderr, " %14s", counter_names[j]);
+  }
+  fprintf(stderr, "\n");
+  for(i=0; i < INKWAVE_STAGES; i++) {
+    s = &stages[i];
+    if(!s->runs) continue;
+    fprintf(stderr, "%-10s %5u %12.1f %12.1f", stage_names[i], s->runs, s->wall_ns / 1000.0, s->cpu_ns / 1000.0);
+    for(j=0; stats->counters && j < INKWAVE_COUNTERS; j++) {
+      fprintf(stderr, " %14llu", (unsigned long long) s->counters[j]);
+    }
+    fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "%-10s %5s %12.1f\n", "total", "", total_ns / 1000.0);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Input bytes: %llu, output bytes: %llu\n", (unsigned long long) in_bytes, (unsigned long long) out_bytes);
+  fprintf(stderr, "read(): %llu calls, %llu bytes\n",
+          (unsigned long long) (end.syscr - start->syscr), (unsigned long long) (end.rchar - start->rchar));
+  fprintf(stderr, "write(): %llu calls, %llu bytes\n",
+          (unsigned long long) (end.syscw - start->syscw), (unsigned long long) (end.wchar - start->wchar));
+  fprintf(stderr, "Waveforms decoded: %u (%u unique)\n", stats->waveforms_decoded, stats->waveforms_unique);
+  fprintf(stderr, "Peak RSS: %ld kB\n", usage.ru_maxrss);
 }
 
 void usage(FILE* fd) {
   fprintf(fd, "\n");
-  fprintf(fd, "Usage: inkwave file.wbf/file.wrf [-o output.wrf]\n");
+  fprintf(fd, "Usage: inkwave file.wbf/file.wrf [-o output.wrf] [-t temps.lut] [-c cache_dir] [-d] [-j n]\n");
+  fprintf(fd, "       inkwave -s [-m size] file.wbf/device/- -o output.wrf [-c cache_dir] [-d]\n");
+  fprintf(fd, "       inkwave -b [-O template] [-c cache_dir] [-d] [-j n] file/dir/- ...\n");
+  fprintf(fd, "       inkwave file.wbf/file.wrf -w mode,range [-x matrices.bin] [-l layout]\n");
+  fprintf(fd, "       inkwave file.wbf/file.wrf -u mode,temp old.pgm new.pgm [-x frames.bin] [-j n]\n");
+  fprintf(fd, "       inkwave --scan[=csv|json] [--crc] [-j n] file/dir/- ...\n");
+  fprintf(fd, "       inkwave file.wbf/file.wrf --serve=socket\n");
+  fprintf(fd, "       inkwave file.wbf/file.wrf --blob=file [-j n]\n");
+  fprintf(fd, "       inkwave --diff old.wbf/old.wrf new.wbf/new.wrf\n");
   fprintf(fd, "\n");
-  fprintf(fd, "  Convert a .wbf file to a .wrf file\n");
+  fprintf(fd, "  Convert a .wbf (or .wrf) file to a .wrf file, or to\n");
+  fprintf(fd, "  a .wbf file if the output file name ends in .wbf,\n");
   fprintf(fd, "  or if no output file is specified display human\n");
   fprintf(fd, "  readable info about the specified .wbf or .wrf file.\n");
+  fprintf(fd, "  Use - as input file to read from stdin (requires -f).\n");
   fprintf(fd, "\n");
   fprintf(fd, "Options:\n");
   fprintf(fd, "\n");
-  fprintf(fd, "  -o: Specify output file.\n");
+  fprintf(fd, "  -o: Specify output file. Use - for stdout.\n");
+  fprintf(fd, "      A .wbf output file gets the smallest encoding\n");
+  fprintf(fd, "      of each waveform and identical waveforms are\n");
+  fprintf(fd, "      stored only once.\n");
   fprintf(fd, "\n");
   fprintf(fd, "  -f wrf/wbf: Force inkwave to interpret input file\n");
   fprintf(fd, "              as either .wrf or .wbf format\n");
   fprintf(fd, "              regardless of file extension.\n");
   fprintf(fd, "\n");
+  fprintf(fd, "  -d: Write waveforms shared by several modes or\n");
+  fprintf(fd, "      temperature ranges only once in the output file.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -j n: Decode waveforms using n threads.\n");
+  fprintf(fd, "        Use 0 for one thread per CPU.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -s: Stream the input: read it once front to back and\n");
+  fprintf(fd, "      decode waveforms as they arrive without ever\n");
+  fprintf(fd, "      holding the whole file in memory. The input can\n");
+  fprintf(fd, "      be a flash device (e.g. /dev/mtd0), a pipe or -.\n");
+  fprintf(fd, "      The output must be a file. Tables are written\n");
+  fprintf(fd, "      first and waveforms follow in .wbf order.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -m size: Input buffer size for -s (default 1M).\n");
+  fprintf(fd, "           Must hold the pointer tables and the\n");
+  fprintf(fd, "           largest waveform. Accepts k, M, G suffixes.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -t file: Write a temperature lookup table: 256\n");
+  fprintf(fd, "           little-endian 16 bit temperature range\n");
+  fprintf(fd, "           indices, one for each °C from 0 to 255.\n");
+  fprintf(fd, "           Colder than the first range maps to the\n");
+  fprintf(fd, "           first range, the upper bound of the last\n");
+  fprintf(fd, "           range or hotter to the last range.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -c dir: Keep converted files in a cache directory.\n");
+  fprintf(fd, "          If the .wbf header (checksum, size, serial,\n");
+  fprintf(fd, "          lot and version) matches a cached file it is\n");
+  fprintf(fd, "          linked or copied to the output without reading\n");
+  fprintf(fd, "          the rest of the input, otherwise the file is\n");
+  fprintf(fd, "          converted and added to the cache.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -b: Batch mode. Verify, or with -O convert, every\n");
+  fprintf(fd, "      .wbf file given as argument, found in a given\n");
+  fprintf(fd, "      directory or listed one per line on stdin (-).\n");
+  fprintf(fd, "      Files are processed in parallel (see -j, default\n");
+  fprintf(fd, "      is one thread per CPU) and a failed file does not\n");
+  fprintf(fd, "      stop the batch. Exits with 1 if any file failed.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -O template: Batch mode output file name.\n");
+  fprintf(fd, "               %%n is replaced by the input file name\n");
+  fprintf(fd, "               without .wbf, %%f by the full input file\n");
+  fprintf(fd, "               name and %%%% by %%. If the template is a\n");
+  fprintf(fd, "               directory output goes to dir/%%n.wrf\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -w mode,range: Print the transition matrices of the\n");
+  fprintf(fd, "                 waveform for a mode and temperature\n");
+  fprintf(fd, "                 range: for every phase the state\n");
+  fprintf(fd, "                 for each old (row) and new (column)\n");
+  fprintf(fd, "                 gray level.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -x file: Instead of printing them write the -w\n");
+  fprintf(fd, "           matrices to a file for use by renderers.\n");
+  fprintf(fd, "           Also used for the -u frames.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -l layout: Matrix layout for -x:\n");
+  fprintf(fd, "             phase: [phase][old][new], a byte per\n");
+  fprintf(fd, "                    state (default)\n");
+  fprintf(fd, "             transition: [old][new][phase], phases\n");
+  fprintf(fd, "                    padded to a multiple of 64\n");
+  fprintf(fd, "             packed: [phase][old][new], four 2 bit\n");
+  fprintf(fd, "                    states per byte, lowest first\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  -u mode,temp: Simulate an update from the old to the\n");
+  fprintf(fd, "                new image (8 bit binary PGM files)\n");
+  fprintf(fd, "                with the waveform for a mode at a\n");
+  fprintf(fd, "                temperature in °C and report its\n");
+  fprintf(fd, "                duration. With -x the drive value of\n");
+  fprintf(fd, "                each pixel in each phase is written\n");
+  fprintf(fd, "                to a file: one frame per phase, four\n");
+  fprintf(fd, "                2 bit pixels per byte, leftmost pixel\n");
+  fprintf(fd, "                lowest. Uses one thread per CPU unless\n");
+  fprintf(fd, "                -j is given.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --scan[=csv|json]: Inventory the .wbf files given\n");
+  fprintf(fd, "                 as for -b: print one line per file\n");
+  fprintf(fd, "                 with its header fields and xwia.\n");
+  fprintf(fd, "                 Only the header and xwia are read\n");
+  fprintf(fd, "                 unless --crc is given. Exits with\n");
+  fprintf(fd, "                 1 if any file failed.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --crc: Also check the CRC-32 of each scanned file.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --serve=socket: Keep the decoded waveforms in memory\n");
+  fprintf(fd, "                 and answer requests for the header,\n");
+  fprintf(fd, "                 temperature ranges and waveforms on\n");
+  fprintf(fd, "                 a Unix socket until interrupted.\n");
+  fprintf(fd, "                 The file is reloaded when it changes.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --blob=file: Write all decoded waveforms as a file\n");
+  fprintf(fd, "                 for readers to map and use in place\n");
+  fprintf(fd, "                 (see struct inkwave_blob). An existing\n");
+  fprintf(fd, "                 file is replaced atomically.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --diff: List the header fields, temperature ranges\n");
+  fprintf(fd, "          and (mode, temperature range) waveforms\n");
+  fprintf(fd, "          that differ between two files. Exits with\n");
+  fprintf(fd, "          0 if there are none, 1 if there are and 2\n");
+  fprintf(fd, "          on errors.\n");
+  fprintf(fd, "\n");
+  fprintf(fd, "  --stats[=text|json][,counters]: Report the wall and\n");
+  fprintf(fd, "                 CPU time of each conversion stage,\n");
+  fprintf(fd, "                 I/O, waveforms decoded and peak\n");
+  fprintf(fd, "                 memory use to stderr. With counters\n");
+  fprintf(fd, "                 also CPU cycles, instructions and\n");
+  fprintf(fd, "                 cache misses (Linux perf events).\n");
+  fprintf(fd, "\n");
   fprintf(fd, "  -h: Display this help message.\n");
   fprintf(fd, "\n");
 }
 
+
 int main(int argc, char **argv) {
 
-  char* data;
+  char* arena_buf = NULL;
   char* infile_path;
-  FILE* infile = NULL;
-  size_t len;
-  struct waveform_data_header* header; // points to `data` at beginning of header
-  struct stat st;
-  char* modes; // points to `data` where the modes table begins
-  char* temp_range_table; // points to `data` where the temp range table begins
-  uint32_t xwia_len;
-  uint8_t mode_count;
-  uint8_t temp_range_count;
+  struct inkwave_input input;
+  struct waveform_data_header* header; // points to `input.data` at beginning of header
+  struct inkwave_arena arena;
+  struct inkwave_model model;
   char* outfile_path = NULL;
-  FILE* outfile = NULL;
   char* force_input = NULL;
   int do_print = 0;
-  int force = 0;
+  int wrf_flags = 0;
+  int threads = 0;
+  int batch = 0;
+  char* out_template = NULL;
+  char* cache_dir = NULL;
+  char cache_name[CACHE_KEY_LEN];
+  char cache_tmp[CACHE_PATH_LEN];
+  int stream = 0;
+  int out_wbf = 0;
+  char* lut_path = NULL;
+  int matrix_wav = 0;
+  unsigned int matrix_mode, matrix_range;
+  char* matrix_path = NULL;
+  int matrix_layout = INKWAVE_MATRIX_PHASE_MAJOR;
+  int sim = 0;
+  unsigned int sim_mode, sim_temp;
+  size_t stream_buf = STREAM_BUF_DEFAULT;
+  struct waveform_data_header cache_header;
+  char* serve_path = NULL;
+  char* blob_path = NULL;
+  int diff = 0;
+  int old_is_wbf;
+  int scan = 0;
+  int scan_crc = 0;
+  int stats_format = STATS_OFF;
+  int stats_counters = 0;
+  struct inkwave_stats stats;
+  struct proc_io stats_io;
+  uint64_t stats_start = 0;
+  int ret;
   int c;
-  uint32_t unique_waveform_count;
-  uint32_t wav_addrs[MAX_WAVEFORMS]; // waveform addresses in input file
   uint32_t is_wbf;
-  size_t to_alloc;
-
-  memset(wav_addrs, 0, sizeof(wav_addrs));
-
-  while((c = getopt(argc, argv, "o:f:h")) != -1) {
+  char err[INKWAVE_ERR_LEN];
+  static const struct option long_options[] = {
+    {"stats", optional_argument, NULL, 'S'},
+    {"scan", optional_argument, NULL, 'I'},
+    {"crc", no_argument, NULL, 'C'},
+    {"serve", required_argument, NULL, 'D'},
+    {"blob", required_argument, NULL, 'B'},
+    {"diff", no_argument, NULL, 'V'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while((c = getopt_long(argc, argv, "o:f:dj:bO:c:sm:t:w:x:l:u:h", long_options, NULL)) != -1) {
     switch (c) {
+    case 'S':
+      stats_format = (optarg) ? parse_stats(optarg, &stats_counters) : STATS_TEXT;
+      if(stats_format < 0) {
+        fprintf(stderr, "Expected --stats=text or --stats=json, optionally followed by ,counters\n");
+        return 1;
+      }
+      break;
+    case 'I':
+      if(!optarg || strcmp(optarg, "csv") == 0) {
+        scan = SCAN_CSV;
+      } else if(strcmp(optarg, "json") == 0) {
+        scan = SCAN_JSON;
+      } else {
+        fprintf(stderr, "Expected --scan=csv or --scan=json\n");
+        return 1;
+      }
+      break;
+    case 'C':
+      scan_crc = 1;
+      break;
+    case 'D':
+      serve_path = optarg;
+      break;
+    case 'B':
+      blob_path = optarg;
+      break;
+    case 'V':
+      diff = 1;
+      break;
     case 'o':
       outfile_path = optarg;
       break;
     case 'f':
       force_input = optarg;
       break;
+    case 'd':
+      wrf_flags |= INKWAVE_WRF_DEDUP;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      if(threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      break;
+    case 'b':
+      batch = 1;
+      break;
+    case 'O':
+      out_template = optarg;
+      break;
+    case 'c':
+      cache_dir = optarg;
+      break;
+    case 's':
+      stream = 1;
+      break;
+    case 'm':
+      stream_buf = parse_size(optarg);
+      break;
+    case 't':
+      lut_path = optarg;
+      break;
+    case 'w':
+      if(sscanf(optarg, "%u,%u", &matrix_mode, &matrix_range) != 2) {
+        fprintf(stderr, "Expected -w mode,range\n");
+        return 1;
+      }
+      matrix_wav = 1;
+      break;
+    case 'x':
+      matrix_path = optarg;
+      break;
+    case 'u':
+      if(sscanf(optarg, "%u,%u", &sim_mode, &sim_temp) != 2 || sim_temp > 255) {
+        fprintf(stderr, "Expected -u mode,temp with temp from 0 to 255\n");
+        return 1;
+      }
+      sim = 1;
+      break;
+    case 'l':
+      matrix_layout = parse_layout(optarg);
+      if(matrix_layout < 0) {
+        fprintf(stderr, "Unknown matrix layout %s\n", optarg);
+        return 1;
+      }
+      break;
     case 'h':
       usage(stdout);
       return 0;
     }
   }
 
+  // like diff(1): 0 if the same, 1 if different, 2 on trouble
+  if(diff) {
+    if(argc != optind + 2) {
+      usage(stderr);
+      return 2;
+    }
+    old_is_wbf = input_format(argv[optind], force_input);
+    ret = input_format(argv[optind + 1], force_input);
+    if(old_is_wbf < 0 || ret < 0) {
+      return 2;
+    }
+    ret = run_diff(argv[optind], old_is_wbf, argv[optind + 1], ret, err);
+    if(ret < 0) {
+      fprintf(stderr, "%s\n", err);
+      return 2;
+    }
+    return ret;
+  }
+
+  if(scan) {
+    if(argc == optind) {
+      usage(stderr);
+      return 1;
+    }
+    if(!threads) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return run_scan(argv + optind, argc - optind, scan, scan_crc, threads) ? 1 : 0;
+  }
+
+  if(batch) {
+    if(argc == optind) {
+      usage(stderr);
+      return 1;
+    }
+    if(!threads) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return run_batch(argv + optind, argc - optind, out_template, cache_dir, wrf_flags, threads) ? 1 : 0;
+  }
+
+  if(!threads) {
+    threads = (sim) ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  }
+
   // expecting exactly one non-option argument
-  if(argc != optind + 1) {
+  // or the input file and two images with -u
+  if(argc != optind + ((sim) ? 3 : 1)) {
     usage(stderr);
     return 1;
   }
 
   infile_path = argv[optind];
+  input.data = NULL;
 
-  if(force_input) {
-    if(strncmp(force_input, "wbf", 3) == 0) {
-      is_wbf = 1;
-    } else if(strncmp(force_input, "wrf", 3) == 0) {
-      is_wbf = 0;
-    } else {
-      fprintf(stderr, "Only wbf and wrf format is supported\n");
+  if(stats_format) {
+    inkwave_stats_init(&stats, stats_counters);
+    read_proc_io(&stats_io);
+    stats_start = wall_ns();
+  }
+
+  ret = input_format(infile_path, force_input);
+  if(ret < 0) {
+    goto fail;
+  }
+  is_wbf = ret;
+
+  if(serve_path) {
+    if(outfile_path || lut_path || blob_path || matrix_wav || sim || stream || cache_dir) {
+      fprintf(stderr, "--serve can't be used together with other options\n");
       goto fail;
     }
-  } else {
-    if(strlen(infile_path) < 4) {
-      fprintf(stderr, "File has neither .wbf or .wrf extension\n");
-      fprintf(stderr, "Consider using `-f` to bypass file format detection\n");
+    if(strcmp(infile_path, "-") == 0) {
+      fprintf(stderr, "--serve needs a file to watch, not stdin\n");
       goto fail;
     }
-    if(strncmp(infile_path + strlen(infile_path) - 4, ".wbf", 4) == 0) {
-      is_wbf = 1;
-    } else if(strncmp(infile_path + strlen(infile_path) - 4, ".wrf", 4) == 0) {
-      is_wbf = 0;
-    } else {
-      fprintf(stderr, "File has neither .wbf or .wrf extension\n");
-      fprintf(stderr, "Consider using `-f` to bypass file format detection\n");
+    if(run_serve(infile_path, is_wbf, serve_path, err) < 0) {
+      fprintf(stderr, "%s\n", err);
       goto fail;
-    }  
+    }
+    goto done;
+  }
+
+  // output format by extension, .wrf unless it's .wbf
+  if(outfile_path && strlen(outfile_path) >= 4
+     && strcmp(outfile_path + strlen(outfile_path) - 4, ".wbf") == 0) {
+    out_wbf = 1;
   }
 
-  if(!is_wbf && outfile_path) {
-    fprintf(stderr, "Conversion from .wrf format not supported\n");
+  if(out_wbf && (stream || cache_dir)) {
+    fprintf(stderr, "A .wbf output file can't be written with -s or -c\n");
     goto fail;
   }
 
-  infile = fopen(infile_path, "r");
-  if(!infile) {
-    fprintf(stderr, "Opening file %s failed: %s\n", infile_path, strerror(errno));
+  // the header of a .wrf describes the .wbf it came from
+  if(!is_wbf && cache_dir) {
+    fprintf(stderr, "A cache directory can only be used with .wbf input\n");
     goto fail;
   }
 
-  if(stat(infile_path, &st) < 0) {
-    fprintf(stderr, "Error getting file size for: %s\n", strerror(errno));
+  // the table comes from the parsed model which these skip
+  if(lut_path && (stream || cache_dir)) {
+    fprintf(stderr, "A temperature lookup table can't be written together with -s or -c\n");
     goto fail;
   }
 
-  if(is_wbf) {
-    to_alloc = st.st_size;
-  } else {
-    to_alloc = sizeof(struct waveform_data_header);
+  if(blob_path && (stream || cache_dir)) {
+    fprintf(stderr, "--blob can't be used together with -s or -c\n");
+    goto fail;
+  }
+
+  if(matrix_path && !matrix_wav && !sim) {
+    fprintf(stderr, "Exporting matrices needs a waveform selected with -w\n");
+    goto fail;
+  }
+
+  if(matrix_wav && sim) {
+    fprintf(stderr, "-w and -u can't be used together\n");
+    goto fail;
   }
 
-  data = malloc(to_alloc);
-  if(!data) {
-    fprintf(stderr, "Failed to allocate %d bytes of memory: %s\n", (int) st.st_size, strerror(errno));
+  // matrices are decoded from the parsed model which these skip
+  if((matrix_wav || sim) && (stream || cache_dir)) {
+    fprintf(stderr, "-w and -u can't be used together with -s or -c\n");
     goto fail;
   }
 
-  if(outfile_path) {
-    outfile = fopen(outfile_path, "w");
-    if(!outfile) {
-      fprintf(stderr, "Opening file %s for writing failed: %s\n", outfile_path, strerror(errno));
+  // on a cache hit only the header of the input file is read
+  if(cache_dir && outfile_path) {
+    if(strcmp(infile_path, "-") == 0) {
+      fprintf(stderr, "A cache directory can't be used when reading from stdin\n");
+      goto fail;
+    }
+    if(cache_key(infile_path, wrf_flags, &cache_header, cache_name, err) < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
+    switch(cache_fetch(cache_dir, cache_name, &cache_header, outfile_path, err)) {
+    case 1:
+      goto done;
+    case -1:
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
+  }
+
+  if(stream) {
+    if(!is_wbf || !outfile_path) {
+      fprintf(stderr, "Streaming needs a .wbf input and an output file\n");
       goto fail;
     }
+
+    // reading, parsing, decoding and writing are interleaved
+    // so the whole conversion is one stage
+    if(cache_dir) {
+      ret = cache_begin(cache_dir, cache_name, cache_tmp, err);
+      if(ret == 0) {
+        inkwave_stats_begin((stats_format) ? &stats : NULL, INKWAVE_STAGE_STREAM);
+        ret = stream_wrf(infile_path, stream_buf, wrf_flags, cache_tmp, err);
+        inkwave_stats_end((stats_format) ? &stats : NULL, INKWAVE_STAGE_STREAM);
+      }
+      if(ret == 0) {
+        ret = cache_commit(cache_dir, cache_name, cache_tmp, outfile_path, err);
+      }
+    } else {
+      inkwave_stats_begin((stats_format) ? &stats : NULL, INKWAVE_STAGE_STREAM);
+      ret = stream_wrf(infile_path, stream_buf, wrf_flags, outfile_path, err);
+      inkwave_stats_end((stats_format) ? &stats : NULL, INKWAVE_STAGE_STREAM);
+    }
+    if(ret < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
+    goto done;
+  }
+
+  inkwave_stats_begin((stats_format) ? &stats : NULL, INKWAVE_STAGE_READ);
+  ret = inkwave_input_open(&input, infile_path);
+  inkwave_stats_end((stats_format) ? &stats : NULL, INKWAVE_STAGE_READ);
+  if(ret < 0) {
+    fprintf(stderr, "%s\n", input.err);
+    goto fail;
+  }
+
+  if(input.size < sizeof(struct waveform_data_header)) {
+    fprintf(stderr, "File too small to contain a waveform header\n");
+    goto fail;
   }
 
-  if(!outfile) {
+  if(!outfile_path && !lut_path && !blob_path && !matrix_wav && !sim) {
     do_print = 1;
   }
 
   if(do_print) {
     printf("\n");
-    printf("File size: %d bytes\n", (int) st.st_size);
+    printf("File size: %d bytes\n", (int) input.size);
     printf("\n");
   }
 
-  len = fread(data, 1, to_alloc, infile);
-  if(len <= 0) {
-    fprintf(stderr, "Reading file %s failed: %s\n", infile_path, strerror(errno));
-    goto fail;
-  }
-
   // start of header
-  header = (struct waveform_data_header*) data;
+  header = (struct waveform_data_header*) input.data;
 
-  if(is_wbf) {
-    if(header->filesize != st.st_size) {
-      fprintf(stderr, "Actual file size does not match file size reported by waveform header\n");
-      goto fail;
-    }
+  arena_buf = malloc(inkwave_arena_size(header));
+  if(!arena_buf) {
+    fprintf(stderr, "Failed to allocate memory: %s\n", strerror(errno));
+    goto fail;
   }
+  inkwave_arena_init(&arena, arena_buf, inkwave_arena_size(header));
 
-  if(outfile) {
-    if(get_bits_per_pixel(header) != 4) {
-      fprintf(stderr, "This waveform uses 5 bits per pixel which is not yet support\n");
+  if(is_wbf) {
+    if(inkwave_parse_wbf_stats(&model, &arena, input.data, input.size, (stats_format) ? &stats : NULL) < 0) {
+      fprintf(stderr, "%s\n", model.err);
       goto fail;
     }
-  }
-
-  if(is_wbf) {
-    if(compare_checksum(data, header) < 0)  {
-      fprintf(stderr, "Checksum error\n");
+  } else {
+    // a .wrf only has tables to check, counted as the modes stage
+    inkwave_stats_begin((stats_format) ? &stats : NULL, INKWAVE_STAGE_MODES);
+    ret = inkwave_parse_wrf(&model, &arena, input.data, input.size);
+    inkwave_stats_end((stats_format) ? &stats : NULL, INKWAVE_STAGE_MODES);
+    if(ret < 0) {
+      fprintf(stderr, "%s\n", model.err);
       goto fail;
     }
+    model.stats = (stats_format) ? &stats : NULL;
   }
 
   if(do_print) {
     print_header(header, is_wbf);
-    
-    if(header->fpl_platform < 3) {
-      printf("Modes: Unknown (no mode version specified)\n");
-    } else {
-      print_modes(header->mc + 1);
+    print_mode_list(header);
+    print_temp_range_table(&model);
+
+    if(model.xwia) {
+      print_xwia(&model);
     }
-  }
 
-  if(!is_wbf) {
-    return 0;
+    printf("Number of unique waveforms: %u\n\n", model.waveform_count);
+
+    print_waveforms(&model);
   }
 
-  if(outfile) {
-    if(write_header(outfile, header) < 0) {
-      fprintf(stderr, "Writing header to output failed\n");
+  if(lut_path) {
+    if(write_temp_lut(&model, lut_path, err) < 0) {
+      fprintf(stderr, "%s\n", err);
       goto fail;
     }
   }
 
-  // start of temperature range table
-  temp_range_table = data + sizeof(struct waveform_data_header);
-
-  if(parse_temp_range_table(temp_range_table, header->trc + 1, outfile, do_print)) {
-    fprintf(stderr, "Temperature range checksum error\n");
-    goto fail;   
-  }
-
-  if(outfile) {
-    if(fseek(outfile, 8 * (header->mc + 1), SEEK_CUR) < 0) {
-      fprintf(stderr, "Error seeking in output file: %s\n", strerror(errno));
-      return -1;      
+  if(blob_path) {
+    if(write_blob(&model, threads, blob_path, err) < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
     }
   }
 
-  if(header->xwia) { // if xwia is 0 then there is no xwia info
-    xwia_len = data[header->xwia];
-
-    if(check_xwia(data + header->xwia, do_print) < 0) {
-      fprintf(stderr, "xwia checksum error\n");
+  if(matrix_wav) {
+    if(matrix_path) {
+      if(write_matrices(&model, matrix_mode, matrix_range, matrix_layout, matrix_path, err) < 0) {
+        fprintf(stderr, "%s\n", err);
+        goto fail;
+      }
+    } else if(print_matrices(&model, matrix_mode, matrix_range, err) < 0) {
+      fprintf(stderr, "%s\n", err);
       goto fail;
     }
-  } else {
-    xwia_len = 0;
   }
 
-  // first byte of xwia contains the length
-  // last byte after xwia is a checksum
-  modes = data + header->xwia + 1 + xwia_len + 1;
-
-  if(parse_modes(header, data, modes, header->mc + 1, header->trc + 1, wav_addrs, 1, NULL, 0) < 0) {
-    fprintf(stderr, "Parse error during first pass\n");
-    goto fail; 
+  if(sim) {
+    if(simulate(&model, sim_mode, sim_temp, argv[optind + 1], argv[optind + 2], threads, matrix_path, err) < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
   }
 
-  unique_waveform_count = bubble_sort(wav_addrs);
-  if(do_print) {
-    printf("Number of unique waveforms: %u\n\n", unique_waveform_count);
-  }
-  
-  // add file endpoint to waveform address table
-  // since we use this to determine end address of each waveform
-  if(add_addr(wav_addrs, st.st_size, MAX_WAVEFORMS) < 0) {
-    fprintf(stderr, "Failed to add file end address to waveform table.\n");
-    goto fail;
+  if(outfile_path && cache_dir) {
+    if(cache_store(cache_dir, cache_name, &model, wrf_flags, threads, outfile_path, err) < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
+  } else if(outfile_path) {
+    // write_wrf() times its own writing apart from decoding
+    if(out_wbf) {
+      inkwave_stats_begin(model.stats, INKWAVE_STAGE_WRITE);
+      ret = write_wbf(&model, outfile_path, err);
+      inkwave_stats_end(model.stats, INKWAVE_STAGE_WRITE);
+    } else {
+      ret = write_wrf(&model, wrf_flags, threads, outfile_path, err);
+    }
+    if(ret < 0) {
+      fprintf(stderr, "%s\n", err);
+      goto fail;
+    }
   }
 
-  // parse modes again since we now have all the sorted waveform addresses
-  if(parse_modes(header, data, modes, header->mc + 1, header->trc + 1, wav_addrs, 0, outfile, do_print) < 0) {
-    fprintf(stderr, "Parse error during second pass\n");
-    goto fail; 
+ done:
+  if(stats_format) {
+    print_stats(stats_format, &stats, wall_ns() - stats_start, &stats_io, (input.data) ? input.size : 0, outfile_path);
+    inkwave_stats_close(&stats);
   }
-
+  inkwave_input_close(&input);
+  free(arena_buf);
   return 0;
 
  fail:
-  if(infile) {
-    fclose(infile);
-  }
-  if(outfile) {
-    fclose(outfile);
+  if(stats_format) {
+    inkwave_stats_close(&stats);
   }
+  inkwave_input_close(&input);
+  free(arena_buf);
   return 1;
 }
@@ -0,0 +1,105 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// Within each phase a .wrf (and inkwave_decode_waveform()) holds the
+// state for a transition from gray level `old` to gray level `new` at
+// new * levels + old, the order the EPDC looks states up in.
+#define RAW(states, levels, phase, old, new) \
+  (states)[((size_t) (phase) * (levels) + (new)) * (levels) + (old)]
+
+// round up to a whole number of cache lines
+static size_t line_align(size_t size) {
+  return (size + INKWAVE_CACHE_LINE - 1) & ~((size_t) INKWAVE_CACHE_LINE - 1);
+}
+
+size_t inkwave_matrix_size(const struct inkwave_model* model, uint32_t state_count, int layout) {
+  uint32_t phase_states = inkwave_phase_states(model->header);
+  size_t phases = state_count / phase_states;
+
+  switch(layout) {
+  case INKWAVE_MATRIX_PHASE_MAJOR:
+    return phases * phase_states;
+  case INKWAVE_MATRIX_TRANSITION_MAJOR:
+    return phase_states * line_align(phases);
+  case INKWAVE_MATRIX_PACKED:
+    return phases * phase_states / 4;
+  }
+  return 0;
+}
+
+// The conversions are instantiated for 16 and 32 gray levels
+// so the inner loops have constant trip counts.
+#define DEFINE_MATRIX_CONVERTERS(levels) \
+  static void phase_major_##levels(const char* states, size_t phases, char* out) { \
+    size_t p; \
+    uint32_t old, new; \
+    \
+    for(p=0; p < phases; p++) { \
+      for(old=0; old < levels; old++) { \
+        for(new=0; new < levels; new++) { \
+          *out++ = RAW(states, levels, p, old, new); \
+        } \
+      } \
+    } \
+  } \
+  \
+  static void transition_major_##levels(const char* states, size_t phases, char* out) { \
+    size_t stride = line_align(phases); \
+    size_t p; \
+    uint32_t old, new; \
+    \
+    memset(out, 0, (size_t) levels * levels * stride); \
+    for(p=0; p < phases; p++) { \
+      for(old=0; old < levels; old++) { \
+        for(new=0; new < levels; new++) { \
+          out[(old * levels + new) * stride + p] = RAW(states, levels, p, old, new); \
+        } \
+      } \
+    } \
+  } \
+  \
+  static void packed_##levels(const char* states, size_t phases, char* out) { \
+    size_t p; \
+    uint32_t old, new; \
+    uint8_t byte; \
+    \
+    for(p=0; p < phases; p++) { \
+      for(old=0; old < levels; old++) { \
+        for(new=0; new < levels; new += 4) { \
+          byte = (RAW(states, levels, p, old, new) & 3) \
+            | (RAW(states, levels, p, old, new + 1) & 3) << 2 \
+            | (RAW(states, levels, p, old, new + 2) & 3) << 4 \
+            | (RAW(states, levels, p, old, new + 3) & 3) << 6; \
+          *out++ = byte; \
+        } \
+      } \
+    } \
+  }
+
+DEFINE_MATRIX_CONVERTERS(16)
+DEFINE_MATRIX_CONVERTERS(32)
+
+long inkwave_to_matrices(const struct inkwave_model* model, const char* states, uint32_t state_count, int layout, char* out) {
+  size_t phases = state_count / inkwave_phase_states(model->header);
+  int bpp5 = (get_bits_per_pixel(model->header) == 5);
+
+  switch(layout) {
+  case INKWAVE_MATRIX_PHASE_MAJOR:
+    (bpp5) ? phase_major_32(states, phases, out) : phase_major_16(states, phases, out);
+    break;
+  case INKWAVE_MATRIX_TRANSITION_MAJOR:
+    (bpp5) ? transition_major_32(states, phases, out) : transition_major_16(states, phases, out);
+    break;
+  case INKWAVE_MATRIX_PACKED:
+    (bpp5) ? packed_32(states, phases, out) : packed_16(states, phases, out);
+    break;
+  default:
+    return -1;
+  }
+
+  return phases;
+}
@@ -0,0 +1,87 @@
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+// A small work-stealing pool. The jobs are split into one contiguous
+// range per thread. Each thread works through its own range first and
+// then steals single jobs from the ranges of the others, so threads
+// that got the cheap jobs help out with the expensive ones.
+
+struct pool_worker {
+  struct pool* pool;
+  pthread_t thread;
+  int started;
+  uint32_t next; // next job to run, shared with thieves
+  uint32_t end;
+};
+
+struct pool {
+  void (*fn)(void* ctx, uint32_t job);
+  void* ctx;
+  int count;
+  struct pool_worker workers[POOL_MAX_THREADS];
+};
+
+static void drain(struct pool* pool, struct pool_worker* w) {
+  uint32_t job;
+
+  while((job = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->end) {
+    pool->fn(pool->ctx, job);
+  }
+}
+
+static void* pool_worker_main(void* arg) {
+  struct pool_worker* self = arg;
+  struct pool* pool = self->pool;
+  int idx = self - pool->workers;
+  int i;
+
+  drain(pool, self);
+
+  for(i=1; i < pool->count; i++) {
+    drain(pool, &pool->workers[(idx + i) % pool->count]);
+  }
+
+  return NULL;
+}
+
+void run_parallel(int threads, uint32_t count, void (*fn)(void* ctx, uint32_t job), void* ctx) {
+  struct pool pool;
+  uint32_t per;
+  int i;
+
+  if(threads > POOL_MAX_THREADS) {
+    threads = POOL_MAX_THREADS;
+  }
+  if(threads < 1 || (uint32_t) threads > count) {
+    threads = (count) ? count : 1;
+  }
+
+  pool.fn = fn;
+  pool.ctx = ctx;
+  pool.count = threads;
+
+  per = count / threads;
+  for(i=0; i < threads; i++) {
+    pool.workers[i].pool = &pool;
+    pool.workers[i].started = 0;
+    pool.workers[i].next = i * per;
+    pool.workers[i].end = (i == threads - 1) ? count : (i + 1) * per;
+  }
+
+  // the calling thread is worker 0. If a thread can't be started
+  // its jobs still get done since everyone steals from everyone.
+  for(i=1; i < threads; i++) {
+    pool.workers[i].started = (pthread_create(&pool.workers[i].thread, NULL, pool_worker_main, &pool.workers[i]) == 0);
+  }
+
+  pool_worker_main(&pool.workers[0]);
+
+  for(i=1; i < threads; i++) {
+    if(pool.workers[i].started) {
+      pthread_join(pool.workers[i].thread, NULL);
+    }
+  }
+}
@@ -0,0 +1,131 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// The LRU is meant to hold the handful of waveforms a running display
+// switches between so lookup and eviction are plain linear scans.
+
+#define LRU_EMPTY (UINT32_MAX)
+
+size_t inkwave_lru_size(uint32_t slot_count, uint32_t slot_size) {
+  // + 8 per allocation for alignment
+  return (slot_count * sizeof(struct inkwave_lru_slot) + 8)
+    + slot_count * ((size_t) slot_size + 8);
+}
+
+int inkwave_lru_init(struct inkwave_lru* lru, struct inkwave_arena* arena, uint32_t slot_count, uint32_t slot_size) {
+  uint32_t i;
+
+  memset(lru, 0, sizeof(struct inkwave_lru));
+
+  lru->slots = inkwave_arena_alloc(arena, slot_count * sizeof(struct inkwave_lru_slot));
+  if(!lru->slots) {
+    return -1;
+  }
+
+  for(i=0; i < slot_count; i++) {
+    lru->slots[i].wav = LRU_EMPTY;
+    lru->slots[i].state_count = 0;
+    lru->slots[i].last_used = 0;
+    lru->slots[i].states = inkwave_arena_alloc(arena, slot_size);
+    if(!lru->slots[i].states) {
+      return -1;
+    }
+  }
+
+  lru->slot_count = slot_count;
+  lru->slot_size = slot_size;
+
+  return 0;
+}
+
+static struct inkwave_lru_slot* lru_find(struct inkwave_lru* lru, uint32_t wav) {
+  uint32_t i;
+
+  for(i=0; i < lru->slot_count; i++) {
+    if(lru->slots[i].wav == wav) {
+      return &lru->slots[i];
+    }
+  }
+  return NULL;
+}
+
+// empty slots have never been used so they go first
+static struct inkwave_lru_slot* lru_victim(struct inkwave_lru* lru) {
+  struct inkwave_lru_slot* victim = &lru->slots[0];
+  uint32_t i;
+
+  for(i=1; i < lru->slot_count; i++) {
+    if(lru->slots[i].last_used < victim->last_used) {
+      victim = &lru->slots[i];
+    }
+  }
+  return victim;
+}
+
+const char* inkwave_query(struct inkwave_model* model, struct inkwave_lru* lru, uint16_t mode, uint16_t temp_range, char* out, size_t out_size, uint32_t* state_count) {
+  struct inkwave_waveform* waveform;
+  struct inkwave_lru_slot* slot;
+  uint32_t wav;
+  long count;
+  long len;
+
+  if(mode >= model->mode_count) {
+    fail(model, "Mode %u out of range (%u modes)", mode, model->mode_count);
+    return NULL;
+  }
+  if(temp_range >= model->temp_range_count) {
+    fail(model, "Temperature range %u out of range (%u ranges)", temp_range, model->temp_range_count);
+    return NULL;
+  }
+
+  wav = model->wav_ids[mode * model->temp_range_count + temp_range];
+  waveform = &model->waveforms[wav];
+
+  // already unpacked
+  if(model->is_wrf) {
+    *state_count = waveform->state_count;
+    return model->data + waveform->addr;
+  }
+
+  if(lru && lru->slot_count) {
+    slot = lru_find(lru, wav);
+    if(slot) {
+      slot->last_used = ++lru->clock;
+      lru->hits++;
+      *state_count = slot->state_count;
+      return slot->states;
+    }
+    lru->misses++;
+  }
+
+  len = waveform_payload_len(model, waveform);
+  if(len < 0) {
+    return NULL;
+  }
+
+  count = count_waveform_states(model->data + waveform->addr, len);
+  waveform->state_count = count;
+  *state_count = count;
+
+  if(lru && lru->slot_count && (uint32_t) count <= lru->slot_size) {
+    slot = lru_victim(lru);
+    decode_waveform(model->data + waveform->addr, len, slot->states);
+    slot->wav = wav;
+    slot->state_count = count;
+    slot->last_used = ++lru->clock;
+    return slot->states;
+  }
+
+  if(!out || (size_t) count > out_size) {
+    fail(model, "Output buffer of %lu bytes is too small for %ld states", (unsigned long) out_size, count);
+    return NULL;
+  }
+
+  decode_waveform(model->data + waveform->addr, len, out);
+  return out;
+}
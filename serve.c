@@ -0,0 +1,642 @@
+
+// for memfd_create()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "inkwave.h"
+#include "cli.h"
+
+// The file is parsed, verified and every unique waveform decoded once
+// into a blob (see inkwave_build_blob()), so the input can be closed
+// (and replaced) right away and a waveform request is answered straight
+// from memory. The blob lives in a sealed memfd where available, which
+// clients can map themselves instead of asking for each waveform.
+// Clients are served from a single thread: all complete requests a
+// client has sent are answered with one sendmsg(), which is what makes
+// batches cheap. Sends never block, answers a client isn't reading are
+// kept until it is and it gets no more until then, so a stalled client
+// doesn't hold up the others.
+
+#define SERVE_MAX_CLIENTS (32)
+// requests answered per sendmsg()
+#define SERVE_BATCH (64)
+// how often the input file is checked for changes
+#define SERVE_CHECK_MS (1000)
+
+struct served {
+  uint32_t generation; // counts loads, so clients can tell a reload
+  const char* blob; // read-only
+  size_t size;
+  int fd; // memfd holding the blob or -1 if it is on the heap
+};
+
+struct client {
+  int fd;
+  size_t len;
+  char buf[SERVE_BATCH * sizeof(struct inkwave_serve_request)];
+
+  // answers the socket didn't take yet, copied since a reload
+  // frees the blob they point into
+  char* out; // NULL if there are none
+  size_t out_len;
+  size_t out_done;
+  int pass_fd; // memfd to go with the first byte of `out` or -1
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+  (void) sig;
+  stop = 1;
+}
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int same_file(const struct stat* a, const struct stat* b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+    && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void free_served(struct served* served) {
+  if(served->fd >= 0) {
+    munmap((void*) served->blob, served->size);
+    close(served->fd);
+  } else {
+    free((void*) served->blob);
+  }
+  served->blob = NULL;
+  served->fd = -1;
+}
+
+// Build the blob for `model` into a sealed memfd, or if there is
+// none into memory, and point `served` at it.
+static int publish(struct inkwave_model* model, struct served* served, char* err) {
+  char* blob;
+  size_t size = inkwave_blob_size(model);
+
+  served->fd = -1;
+
+#ifdef MFD_ALLOW_SEALING
+  served->fd = memfd_create("inkwave", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(served->fd >= 0) {
+    if(ftruncate(served->fd, size) < 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Error allocating %lu bytes of shared memory: %s", (unsigned long) size, strerror(errno));
+      close(served->fd);
+      return -1;
+    }
+    blob = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, served->fd, 0);
+    if(blob == MAP_FAILED) {
+      snprintf(err, INKWAVE_ERR_LEN, "Mapping shared memory failed: %s", strerror(errno));
+      close(served->fd);
+      return -1;
+    }
+    if(inkwave_build_blob(model, 1, blob, size) < 0) {
+      strcpy(err, model->err);
+      munmap(blob, size);
+      close(served->fd);
+      return -1;
+    }
+    munmap(blob, size);
+
+    // clients get the same memory so nobody may change it
+    if(fcntl(served->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+       || (blob = mmap(NULL, size, PROT_READ, MAP_SHARED, served->fd, 0)) == MAP_FAILED) {
+      snprintf(err, INKWAVE_ERR_LEN, "Sealing shared memory failed: %s", strerror(errno));
+      close(served->fd);
+      return -1;
+    }
+    served->blob = blob;
+    served->size = size;
+    return 0;
+  }
+#endif
+
+  blob = aligned_alloc(INKWAVE_CACHE_LINE, (size + INKWAVE_CACHE_LINE - 1) & ~((size_t) INKWAVE_CACHE_LINE - 1));
+  if(!blob) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate %lu bytes of memory: %s", (unsigned long) size, strerror(errno));
+    return -1;
+  }
+  if(inkwave_build_blob(model, 1, blob, size) < 0) {
+    strcpy(err, model->err);
+    free(blob);
+    return -1;
+  }
+  served->blob = blob;
+  served->size = size;
+  return 0;
+}
+
+// Parse and decode the file into `served`, which is only
+// changed on success.
+static int load(const char* path, int is_wbf, struct served* served, char* err) {
+  struct inkwave_input input;
+  struct inkwave_arena arena;
+  struct inkwave_model model;
+  struct served loaded;
+  char* arena_buf = NULL;
+  size_t arena_size;
+  int ret = -1;
+
+  if(inkwave_input_open(&input, path) < 0) {
+    strcpy(err, input.err);
+    return -1;
+  }
+
+  if(input.size < sizeof(struct waveform_data_header)) {
+    snprintf(err, INKWAVE_ERR_LEN, "File too small to contain a waveform header");
+    goto out;
+  }
+
+  arena_size = inkwave_arena_size((const struct waveform_data_header*) input.data);
+  arena_buf = malloc(arena_size);
+  if(!arena_buf) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    goto out;
+  }
+  inkwave_arena_init(&arena, arena_buf, arena_size);
+
+  if(is_wbf) {
+    ret = inkwave_parse_wbf(&model, &arena, input.data, input.size);
+  } else {
+    ret = inkwave_parse_wrf(&model, &arena, input.data, input.size);
+  }
+  if(ret < 0) {
+    strcpy(err, model.err);
+    goto out;
+  }
+
+  ret = publish(&model, &loaded, err);
+  if(ret < 0) {
+    goto out;
+  }
+
+  loaded.generation = served->generation + 1;
+  free_served(served);
+  *served = loaded;
+
+ out:
+  free(arena_buf);
+  inkwave_input_close(&input);
+  return ret;
+}
+
+// Answer one request with `resp` and the data in `iov`. Errors use
+// `msg` (INKWAVE_ERR_LEN bytes) for the message.
+static void answer(const struct served* served, const struct inkwave_serve_request* req, struct inkwave_serve_response* resp, struct iovec* iov, char* msg) {
+  const struct inkwave_blob* blob = (const struct inkwave_blob*) served->blob;
+  uint32_t mode = req->arg[0];
+  uint32_t temp_range;
+  uint32_t state_count;
+
+  resp->status = 0;
+  resp->value = 0;
+  iov->iov_base = NULL;
+  iov->iov_len = 0;
+
+  switch(req->op) {
+  case INKWAVE_SERVE_HEADER:
+    resp->value = served->generation;
+    iov->iov_base = (void*) (served->blob + blob->header);
+    iov->iov_len = sizeof(struct waveform_data_header) + blob->temp_range_count + 1;
+    break;
+
+  case INKWAVE_SERVE_TEMP_RANGE:
+    if(req->arg[0] > 255) {
+      snprintf(msg, INKWAVE_ERR_LEN, "Temperature %u out of range (0 to 255)", req->arg[0]);
+      goto fail;
+    }
+    resp->value = inkwave_blob_temp_range(served->blob, req->arg[0]);
+    break;
+
+  case INKWAVE_SERVE_WAVEFORM:
+  case INKWAVE_SERVE_WAVEFORM_RANGE:
+    if(req->op == INKWAVE_SERVE_WAVEFORM) {
+      if(req->arg[1] > 255) {
+        snprintf(msg, INKWAVE_ERR_LEN, "Temperature %u out of range (0 to 255)", req->arg[1]);
+        goto fail;
+      }
+      temp_range = inkwave_blob_temp_range(served->blob, req->arg[1]);
+    } else {
+      temp_range = req->arg[1];
+    }
+    if(mode >= blob->mode_count) {
+      snprintf(msg, INKWAVE_ERR_LEN, "Mode %u out of range (%u modes)", mode, blob->mode_count);
+      goto fail;
+    }
+    if(temp_range >= blob->temp_range_count) {
+      snprintf(msg, INKWAVE_ERR_LEN, "Temperature range %u out of range (%u ranges)", temp_range, blob->temp_range_count);
+      goto fail;
+    }
+    resp->value = temp_range;
+    iov->iov_base = (void*) inkwave_blob_waveform(served->blob, mode, temp_range, &state_count);
+    iov->iov_len = state_count;
+    break;
+
+  case INKWAVE_SERVE_BLOB:
+    // the descriptor goes along with the response, see send_all()
+    if(served->fd < 0) {
+      snprintf(msg, INKWAVE_ERR_LEN, "No shared memory on this system");
+      goto fail;
+    }
+    resp->value = served->generation;
+    break;
+
+  default:
+    snprintf(msg, INKWAVE_ERR_LEN, "Unknown request %u", req->op);
+    goto fail;
+  }
+
+  resp->len = iov->iov_len;
+  return;
+
+ fail:
+  resp->status = -1;
+  iov->iov_base = msg;
+  iov->iov_len = strlen(msg);
+  resp->len = iov->iov_len;
+}
+
+// Send as much of `iov` as the socket takes without blocking, passing
+// `*pass_fd` along with the first byte unless it is -1. `iov` and
+// `*pass_fd` are updated to what is left.
+static int send_some(int fd, struct iovec** iov, int* iov_count, int* pass_fd) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr* cmsg;
+  struct msghdr msg;
+  ssize_t sent;
+
+  while(*iov_count) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = *iov;
+    msg.msg_iovlen = *iov_count;
+
+    if(*pass_fd >= 0) {
+      memset(&control, 0, sizeof(control));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), pass_fd, sizeof(int));
+    }
+
+    // a client that went away must not kill the daemon with SIGPIPE
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(sent < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    *pass_fd = -1;
+
+    while(*iov_count && (size_t) sent >= (*iov)->iov_len) {
+      sent -= (*iov)->iov_len;
+      (*iov)++;
+      (*iov_count)--;
+    }
+    if(*iov_count) {
+      (*iov)->iov_base = (char*) (*iov)->iov_base + sent;
+      (*iov)->iov_len -= sent;
+    }
+  }
+
+  return 0;
+}
+
+// Send `iov` to a client with nothing queued, passing `pass_fd` along
+// with the first byte unless it is -1, and queue what is left.
+static int send_answers(struct client* client, struct iovec* iov, int iov_count, int pass_fd) {
+  size_t len = 0;
+  int i;
+
+  if(send_some(client->fd, &iov, &iov_count, &pass_fd) < 0) {
+    return -1;
+  }
+  if(!iov_count) {
+    return 0;
+  }
+
+  for(i=0; i < iov_count; i++) {
+    len += iov[i].iov_len;
+  }
+  client->out = malloc(len);
+  if(!client->out) {
+    return -1;
+  }
+  for(i=0, len=0; i < iov_count; i++) {
+    memcpy(client->out + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  client->out_len = len;
+  client->out_done = 0;
+
+  // the served memfd may be replaced by a reload meanwhile
+  if(pass_fd >= 0) {
+    client->pass_fd = dup(pass_fd);
+    if(client->pass_fd < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Send what is queued for a client.
+static int flush_client(struct client* client) {
+  struct iovec iov_buf;
+  struct iovec* iov = &iov_buf;
+  int iov_count = 1;
+  int pass_fd = client->pass_fd;
+
+  iov_buf.iov_base = client->out + client->out_done;
+  iov_buf.iov_len = client->out_len - client->out_done;
+  if(send_some(client->fd, &iov, &iov_count, &pass_fd) < 0) {
+    return -1;
+  }
+
+  if(pass_fd < 0 && client->pass_fd >= 0) {
+    close(client->pass_fd);
+    client->pass_fd = -1;
+  }
+  if(iov_count) {
+    client->out_done = client->out_len - iov_buf.iov_len;
+    return 0;
+  }
+
+  free(client->out);
+  client->out = NULL;
+  return 0;
+}
+
+static void drop_client(struct client* client) {
+  close(client->fd);
+  if(client->pass_fd >= 0) {
+    close(client->pass_fd);
+  }
+  free(client->out);
+}
+
+// Answer the complete requests a client has sent, until an answer
+// can't be sent right away. Returns -1 if the client should be dropped.
+static int answer_requests(const struct served* served, struct client* client) {
+  struct inkwave_serve_request req;
+  struct inkwave_serve_response resps[SERVE_BATCH];
+  struct iovec iov[2 * SERVE_BATCH];
+  char msgs[SERVE_BATCH][INKWAVE_ERR_LEN];
+  size_t count, done, i, first;
+
+  // A blob answer carries the memfd, which has to arrive with the
+  // first byte of that answer, so earlier answers are sent first.
+  // Requests after a queued answer are answered once it is sent.
+  count = client->len / sizeof(struct inkwave_serve_request);
+  for(i=0, first=0; i < count && !client->out; i++) {
+    memcpy(&req, client->buf + i * sizeof(req), sizeof(req));
+    answer(served, &req, &resps[i], &iov[2 * i + 1], msgs[i]);
+    iov[2 * i].iov_base = &resps[i];
+    iov[2 * i].iov_len = sizeof(struct inkwave_serve_response);
+
+    if(req.op == INKWAVE_SERVE_BLOB && resps[i].status == 0) {
+      if(send_answers(client, iov + 2 * first, 2 * (i - first), -1) < 0) {
+        return -1;
+      }
+      first = i;
+      if(client->out) {
+        break;
+      }
+      if(send_answers(client, iov + 2 * i, 2, served->fd) < 0) {
+        return -1;
+      }
+      first = i + 1;
+    }
+  }
+  if(!client->out) {
+    if(send_answers(client, iov + 2 * first, 2 * (i - first), -1) < 0) {
+      return -1;
+    }
+    first = i;
+  }
+
+  // keep the rest, including a partial request, for later
+  done = first * sizeof(struct inkwave_serve_request);
+  memmove(client->buf, client->buf + done, client->len - done);
+  client->len -= done;
+
+  return 0;
+}
+
+// Read what the client sent and answer it.
+// Returns -1 if the client should be dropped.
+static int serve_client(const struct served* served, struct client* client) {
+  ssize_t n;
+
+  n = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+  if(n < 0 && errno == EINTR) {
+    return 0;
+  }
+  if(n <= 0) {
+    return -1;
+  }
+  client->len += n;
+
+  return answer_requests(served, client);
+}
+
+static int open_socket(const char* path, char* err) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    snprintf(err, INKWAVE_ERR_LEN, "Socket path %s is too long", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Creating socket failed: %s", strerror(errno));
+    return -1;
+  }
+
+  // a socket left behind by a daemon that is no longer running
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+      snprintf(err, INKWAVE_ERR_LEN, "Socket %s is in use by another process", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, SERVE_MAX_CLIENTS) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Listening on %s failed: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void accept_client(int listen_fd, struct client* clients, int* client_count) {
+  int fd;
+
+  fd = accept(listen_fd, NULL, NULL);
+  if(fd < 0) {
+    return;
+  }
+  if(*client_count == SERVE_MAX_CLIENTS) {
+    fprintf(stderr, "Too many clients, dropping a new connection\n");
+    close(fd);
+    return;
+  }
+
+  clients[*client_count].fd = fd;
+  clients[*client_count].len = 0;
+  clients[*client_count].out = NULL;
+  clients[*client_count].pass_fd = -1;
+  (*client_count)++;
+}
+
+// Reload if the file is different from when it was last looked at. A
+// file that fails to load (e.g. while it is being replaced) is retried
+// once it changes again and the old waveforms are served meanwhile.
+static void check_reload(const char* path, int is_wbf, struct served* served, struct stat* seen) {
+  struct stat st;
+  char err[INKWAVE_ERR_LEN];
+
+  if(stat(path, &st) < 0 || same_file(&st, seen)) {
+    return;
+  }
+  *seen = st;
+
+  if(load(path, is_wbf, served, err) < 0) {
+    fprintf(stderr, "Reloading %s failed, keeping the previous version: %s\n", path, err);
+    return;
+  }
+  fprintf(stderr, "Reloaded %s (generation %u)\n", path, served->generation);
+}
+
+int run_serve(const char* in_path, int is_wbf, const char* socket_path, char* err) {
+  struct served served;
+  struct client* clients;
+  struct pollfd fds[1 + SERVE_MAX_CLIENTS];
+  struct sigaction sa;
+  struct stat seen;
+  uint64_t last_check;
+  int client_count = 0;
+  int listen_fd;
+  int i, ret;
+
+  memset(&served, 0, sizeof(served));
+  served.fd = -1;
+
+  // before loading, so a change while loading is picked up
+  if(stat(in_path, &seen) < 0) {
+    snprintf(err, INKWAVE_ERR_LEN, "Error getting file info for %s: %s", in_path, strerror(errno));
+    return -1;
+  }
+  if(load(in_path, is_wbf, &served, err) < 0) {
+    return -1;
+  }
+
+  clients = malloc(SERVE_MAX_CLIENTS * sizeof(struct client));
+  if(!clients) {
+    snprintf(err, INKWAVE_ERR_LEN, "Failed to allocate memory: %s", strerror(errno));
+    free_served(&served);
+    return -1;
+  }
+
+  listen_fd = open_socket(socket_path, err);
+  if(listen_fd < 0) {
+    free(clients);
+    free_served(&served);
+    return -1;
+  }
+
+  // no SA_RESTART so poll() returns on a signal
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  fprintf(stderr, "Serving %s on %s\n", in_path, socket_path);
+  last_check = now_ms();
+
+  while(!stop) {
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for(i=0; i < client_count; i++) {
+      fds[1 + i].fd = clients[i].fd;
+      // no new requests until the answers are read
+      fds[1 + i].events = (clients[i].out) ? POLLOUT : POLLIN;
+    }
+
+    if(poll(fds, 1 + client_count, SERVE_CHECK_MS) < 0 && errno != EINTR) {
+      snprintf(err, INKWAVE_ERR_LEN, "poll() failed: %s", strerror(errno));
+      break;
+    }
+
+    // between requests so every answer comes from one version
+    if(now_ms() - last_check >= SERVE_CHECK_MS) {
+      check_reload(in_path, is_wbf, &served, &seen);
+      last_check = now_ms();
+    }
+
+    // backwards so dropping a client doesn't skip one
+    for(i=client_count - 1; i >= 0; i--) {
+      if(!(fds[1 + i].revents & (fds[1 + i].events | POLLHUP | POLLERR))) continue;
+
+      if(clients[i].out) {
+        ret = flush_client(&clients[i]);
+        if(ret == 0 && !clients[i].out) {
+          ret = answer_requests(&served, &clients[i]);
+        }
+      } else {
+        ret = serve_client(&served, &clients[i]);
+      }
+      if(ret < 0) {
+        drop_client(&clients[i]);
+        clients[i] = clients[--client_count];
+      }
+    }
+
+    if(fds[0].revents & POLLIN) {
+      accept_client(listen_fd, clients, &client_count);
+    }
+  }
+
+  for(i=0; i < client_count; i++) {
+    drop_client(&clients[i]);
+  }
+  close(listen_fd);
+  unlink(socket_path);
+  free(clients);
+  free_served(&served);
+
+  return (stop) ? 0 : -1;
+}
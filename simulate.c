@@ -0,0 +1,169 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// The waveform is turned into transition-major matrices, so the drive
+// values of one transition in all phases are contiguous, in four copies
+// shifted into each 2 bit position of an output byte. The output byte of
+// four pixels for a run of phases is then the OR of four contiguous runs,
+// which the compiler vectorizes. Blocks of output bytes are gathered this
+// way and then transposed into the frames. Rows are spread over threads.
+
+// output bytes (four pixels each) gathered at a time
+#define SIM_BLOCK (16)
+// phases gathered at a time
+#define SIM_PHASES (256)
+
+struct sim_ctx {
+  const uint8_t* old_img;
+  const uint8_t* new_img;
+  const uint8_t* shifted[4];
+  size_t stride; // bytes per transition in each shifted copy
+  uint32_t width;
+  uint32_t levels;
+  uint32_t phases;
+  uint32_t row_bytes;
+  size_t frame_size;
+  char* out;
+};
+
+uint32_t inkwave_frame_rate(const struct waveform_data_header* header) {
+  uint32_t tens = header->fpl_rate >> 4;
+  uint32_t ones = header->fpl_rate & 0xf;
+
+  // stored as two decimal digits, e.g. 0x85 for 85Hz
+  if(tens > 9 || ones > 9) {
+    return 0;
+  }
+  return tens * 10 + ones;
+}
+
+// the matrices with one more all zero transition for the pixels
+// that pad the last byte of a row
+static size_t shifted_size(const struct inkwave_model* model, uint32_t state_count) {
+  uint32_t phase_states = inkwave_phase_states(model->header);
+  size_t phases = state_count / phase_states;
+  size_t stride = (phases + INKWAVE_CACHE_LINE - 1) & ~((size_t) INKWAVE_CACHE_LINE - 1);
+
+  return (phase_states + 1) * stride;
+}
+
+size_t inkwave_sim_arena_size(const struct inkwave_model* model, uint32_t state_count) {
+  // + 8 per allocation for alignment
+  return 4 * (shifted_size(model, state_count) + 8);
+}
+
+size_t inkwave_sim_size(const struct inkwave_model* model, uint32_t state_count, uint32_t width, uint32_t height) {
+  size_t phases = state_count / inkwave_phase_states(model->header);
+
+  return phases * height * (((size_t) width + 3) / 4);
+}
+
+static void sim_row(void* arg, uint32_t y) {
+  struct sim_ctx* ctx = arg;
+  const uint8_t* old_row = ctx->old_img + (size_t) y * ctx->width;
+  const uint8_t* new_row = ctx->new_img + (size_t) y * ctx->width;
+  const uint8_t* seq[SIM_BLOCK][4];
+  uint8_t gathered[SIM_BLOCK][SIM_PHASES];
+  uint32_t mask = ctx->levels - 1;
+  uint32_t pad = ctx->levels * ctx->levels;
+  const uint8_t *a, *b, *c, *d;
+  uint32_t byte, bytes, j, k, x, t;
+  uint32_t p0, p, pn;
+  char* out;
+
+  for(byte=0; byte < ctx->row_bytes; byte += SIM_BLOCK) {
+    bytes = ctx->row_bytes - byte;
+    if(bytes > SIM_BLOCK) {
+      bytes = SIM_BLOCK;
+    }
+
+    for(j=0; j < bytes; j++) {
+      for(k=0; k < 4; k++) {
+        x = (byte + j) * 4 + k;
+        t = (x < ctx->width) ? (old_row[x] & mask) * ctx->levels + (new_row[x] & mask) : pad;
+        seq[j][k] = ctx->shifted[k] + t * ctx->stride;
+      }
+    }
+
+    for(p0=0; p0 < ctx->phases; p0 += SIM_PHASES) {
+      pn = ctx->phases - p0;
+      if(pn > SIM_PHASES) {
+        pn = SIM_PHASES;
+      }
+
+      for(j=0; j < bytes; j++) {
+        a = seq[j][0] + p0;
+        b = seq[j][1] + p0;
+        c = seq[j][2] + p0;
+        d = seq[j][3] + p0;
+        for(p=0; p < pn; p++) {
+          gathered[j][p] = a[p] | b[p] | c[p] | d[p];
+        }
+      }
+
+      for(p=0; p < pn; p++) {
+        out = ctx->out + (p0 + p) * ctx->frame_size + (size_t) y * ctx->row_bytes + byte;
+        for(j=0; j < bytes; j++) {
+          out[j] = gathered[j][p];
+        }
+      }
+    }
+  }
+}
+
+int inkwave_simulate(struct inkwave_model* model, struct inkwave_arena* arena, const char* states, uint32_t state_count, const uint8_t* old_img, const uint8_t* new_img, uint32_t width, uint32_t height, int threads, char* out, struct inkwave_sim* sim) {
+  struct sim_ctx ctx;
+  uint32_t frame_rate;
+  size_t size, i;
+  uint8_t* shifted[4];
+  int k;
+
+  size = shifted_size(model, state_count);
+  for(k=0; k < 4; k++) {
+    shifted[k] = inkwave_arena_alloc(arena, size);
+    if(!shifted[k]) {
+      return fail(model, "Arena too small for the transition matrices");
+    }
+  }
+
+  ctx.levels = (get_bits_per_pixel(model->header) == 5) ? 32 : 16;
+  ctx.phases = inkwave_to_matrices(model, states, state_count, INKWAVE_MATRIX_TRANSITION_MAJOR, (char*) shifted[0]);
+  ctx.stride = size / (ctx.levels * ctx.levels + 1);
+  memset(shifted[0] + size - ctx.stride, 0, ctx.stride);
+  for(i=0; i < size; i++) {
+    shifted[0][i] &= 3;
+    shifted[1][i] = shifted[0][i] << 2;
+    shifted[2][i] = shifted[0][i] << 4;
+    shifted[3][i] = shifted[0][i] << 6;
+  }
+
+  ctx.old_img = old_img;
+  ctx.new_img = new_img;
+  for(k=0; k < 4; k++) {
+    ctx.shifted[k] = shifted[k];
+  }
+  ctx.width = width;
+  ctx.row_bytes = (width + 3) / 4;
+  ctx.frame_size = (size_t) ctx.row_bytes * height;
+  ctx.out = out;
+
+  if(width && height && ctx.phases) {
+    run_parallel(threads, height, sim_row, &ctx);
+  }
+
+  frame_rate = inkwave_frame_rate(model->header);
+
+  sim->width = width;
+  sim->height = height;
+  sim->phases = ctx.phases;
+  sim->row_bytes = ctx.row_bytes;
+  sim->frame_rate = frame_rate;
+  sim->duration_ms = (frame_rate) ? (uint32_t) (((uint64_t) ctx.phases * 1000 + frame_rate / 2) / frame_rate) : 0;
+
+  return 0;
+}
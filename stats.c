@@ -0,0 +1,122 @@
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENT
+#endif
+
+#include "inkwave.h"
+
+// Stages can be entered more than once, each run adds to the totals.
+// Hardware counters count the whole process including threads started
+// after they were opened (inherit), which is how the decoding threads
+// are covered. Their counts are added up when the threads exit, which
+// happens before the decode stage ends.
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef HAVE_PERF_EVENT
+static int open_counter(uint64_t config) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void inkwave_stats_init(struct inkwave_stats* stats, int counters) {
+#ifdef HAVE_PERF_EVENT
+  static const uint64_t configs[INKWAVE_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+#endif
+  int i;
+
+  memset(stats, 0, sizeof(struct inkwave_stats));
+  for(i=0; i < INKWAVE_COUNTERS; i++) {
+    stats->counter_fds[i] = -1;
+  }
+
+#ifdef HAVE_PERF_EVENT
+  for(i=0; counters && i < INKWAVE_COUNTERS; i++) {
+    stats->counter_fds[i] = open_counter(configs[i]);
+    if(stats->counter_fds[i] >= 0) {
+      stats->counters = 1;
+    }
+  }
+#else
+  (void) counters;
+#endif
+}
+
+void inkwave_stats_close(struct inkwave_stats* stats) {
+  int i;
+
+  for(i=0; i < INKWAVE_COUNTERS; i++) {
+    if(stats->counter_fds[i] >= 0) {
+      close(stats->counter_fds[i]);
+      stats->counter_fds[i] = -1;
+    }
+  }
+}
+
+static void read_counters(const struct inkwave_stats* stats, uint64_t* values) {
+  int i;
+
+  for(i=0; i < INKWAVE_COUNTERS; i++) {
+    if(stats->counter_fds[i] < 0 || read(stats->counter_fds[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+      values[i] = 0;
+    }
+  }
+}
+
+void inkwave_stats_begin(struct inkwave_stats* stats, int stage) {
+  struct inkwave_stage_stats* s;
+
+  if(!stats) return;
+  s = &stats->stages[stage];
+
+  if(stats->counters) {
+    read_counters(stats, s->start_counters);
+  }
+  s->start_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  s->start_wall_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+void inkwave_stats_end(struct inkwave_stats* stats, int stage) {
+  struct inkwave_stage_stats* s;
+  uint64_t values[INKWAVE_COUNTERS];
+  int i;
+
+  if(!stats) return;
+  s = &stats->stages[stage];
+
+  s->wall_ns += clock_ns(CLOCK_MONOTONIC) - s->start_wall_ns;
+  s->cpu_ns += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - s->start_cpu_ns;
+  if(stats->counters) {
+    read_counters(stats, values);
+    for(i=0; i < INKWAVE_COUNTERS; i++) {
+      s->counters[i] += values[i] - s->start_counters[i];
+    }
+  }
+  s->runs++;
+}
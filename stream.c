@@ -0,0 +1,512 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "inkwave.h"
+#include "internal.h"
+
+// Streaming conversion reads the input exactly once, front to back.
+// A reader thread pulls fixed size chunks from the input while the
+// calling thread checksums them and decodes every waveform as soon
+// as all of its bytes have arrived, so slow flash reads overlap with
+// decoding. Only a window of the input is kept in memory: first
+// everything up to the end of the pointer tables, then from the
+// start of the waveform being decoded onwards.
+//
+// Since the state counts are only known once a waveform has been
+// read, the .wrf is laid out differently from inkwave_build_wrf():
+// all tables come first, followed by the waveforms in the order they
+// appear in the .wbf file. The tables are written last.
+
+#define STREAM_CHUNKS (4)
+#define STREAM_CHUNK_MIN (4 * 1024)
+#define STREAM_CHUNK_MAX (64 * 1024)
+
+struct stream_chunk {
+  char* data;
+  size_t len;
+};
+
+// chunks are filled by the reader thread in order and
+// handed to the consumer in the same order
+struct stream_reader {
+  int fd;
+  size_t remaining; // bytes left to read
+  size_t offset; // file offset reached, including a failed chunk
+  size_t chunk_size;
+  struct stream_chunk chunks[STREAM_CHUNKS];
+  uint32_t head; // chunks filled so far
+  uint32_t tail; // chunks consumed so far
+  int done; // reader thread has exited
+  int error; // errno of a failed read or -1 on early end of file
+  int stop; // consumer gave up
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// bytes [base, base + fill) of the input file
+struct stream_window {
+  char* buf;
+  size_t cap;
+  size_t base;
+  size_t fill;
+  uint32_t crc;
+};
+
+static size_t chunk_size(size_t buf_size) {
+  size_t size = buf_size / (2 * STREAM_CHUNKS);
+
+  if(size < STREAM_CHUNK_MIN) return STREAM_CHUNK_MIN;
+  if(size > STREAM_CHUNK_MAX) return STREAM_CHUNK_MAX;
+  return size;
+}
+
+// header, temperatures, mode table and all temperature range tables
+static size_t table_size(const struct waveform_data_header* header) {
+  size_t mode_count = header->mc + 1;
+
+  return sizeof(struct waveform_data_header) + header->trc + 2
+    + 8 * mode_count + 8 * mode_count * (header->trc + 1);
+}
+
+int inkwave_stream_open(struct inkwave_stream* stream, int fd, size_t buf_size) {
+  size_t len = 0;
+  ssize_t ret;
+
+  memset(stream, 0, sizeof(struct inkwave_stream));
+  stream->fd = fd;
+  stream->buf_size = buf_size;
+
+  while(len < sizeof(stream->header)) {
+    ret = read(fd, (char*) &stream->header + len, sizeof(stream->header) - len);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      snprintf(stream->err, sizeof(stream->err), "Reading waveform header failed: %s", strerror(errno));
+      return -1;
+    }
+    if(ret == 0) {
+      snprintf(stream->err, sizeof(stream->err), "File too small to contain a waveform header");
+      return -1;
+    }
+    len += ret;
+  }
+
+  if(stream->header.filesize < sizeof(stream->header)) {
+    snprintf(stream->err, sizeof(stream->err), "File size reported by waveform header is too small");
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t inkwave_stream_arena_size(const struct inkwave_stream* stream) {
+  size_t refs_count = (size_t) (stream->header.mc + 1) * (stream->header.trc + 1);
+
+  // + 8 per allocation for alignment
+  return inkwave_arena_size(&stream->header)
+    + (stream->buf_size + 8) // window
+    + (STREAM_CHUNKS * chunk_size(stream->buf_size) + 8)
+    + (stream->buf_size + 8) // decoded waveform
+    + (table_size(&stream->header) + 8)
+    + (256 + 8) // xwia
+    + ((refs_count + 1) * sizeof(uint32_t) + 8) // refs by waveform
+    + (refs_count * sizeof(uint32_t) + 8);
+}
+
+static void* reader_main(void* arg) {
+  struct stream_reader* r = arg;
+  struct stream_chunk* c;
+  size_t want;
+  ssize_t ret;
+  int error = 0;
+
+  while(r->remaining) {
+    pthread_mutex_lock(&r->lock);
+    while(r->head - r->tail == STREAM_CHUNKS && !r->stop) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if(r->stop) {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    c = &r->chunks[r->head % STREAM_CHUNKS];
+    pthread_mutex_unlock(&r->lock);
+
+    // never read past the end of the .wbf, a flash
+    // partition is usually larger than the file in it
+    want = (r->remaining < r->chunk_size) ? r->remaining : r->chunk_size;
+    c->len = 0;
+    while(c->len < want) {
+      ret = read(r->fd, c->data + c->len, want - c->len);
+      if(ret < 0) {
+        if(errno == EINTR) continue;
+        error = errno;
+        break;
+      }
+      if(ret == 0) {
+        error = -1;
+        break;
+      }
+      c->len += ret;
+    }
+    if(error) {
+      r->offset += c->len;
+      break;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->offset += c->len;
+    r->remaining -= c->len;
+    r->head++;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->error = error;
+  r->done = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  return NULL;
+}
+
+// next filled chunk or NULL if the reader failed
+static struct stream_chunk* next_chunk(struct stream_reader* r) {
+  struct stream_chunk* c = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  while(r->tail == r->head && !r->done) {
+    pthread_cond_wait(&r->cond, &r->lock);
+  }
+  if(r->tail != r->head) {
+    c = &r->chunks[r->tail % STREAM_CHUNKS];
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  return c;
+}
+
+static void release_chunk(struct stream_reader* r) {
+  pthread_mutex_lock(&r->lock);
+  r->tail++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Read until the window holds everything below `end`,
+// dropping whatever is below `keep` to make room.
+static int window_fill(struct inkwave_model* model, struct stream_reader* r, struct stream_window* w, size_t end, size_t keep) {
+  struct stream_chunk* c;
+  size_t drop;
+
+  while(w->base + w->fill < end) {
+    c = next_chunk(r);
+    if(!c) {
+      if(r->error > 0) {
+        return fail(model, "Reading file failed: %s", strerror(r->error));
+      }
+      return fail(model, "File ended after %lu bytes but header says it is %u bytes", (unsigned long) r->offset, model->header->filesize);
+    }
+
+    if(keep > w->base) {
+      drop = keep - w->base;
+      if(drop > w->fill) {
+        drop = w->fill;
+      }
+      memmove(w->buf, w->buf + drop, w->fill - drop);
+      w->base += drop;
+      w->fill -= drop;
+    }
+
+    if(w->fill + c->len > w->cap) {
+      release_chunk(r);
+      return fail(model, "Stream buffer of %lu bytes is too small to hold 0x%lx to 0x%lx", (unsigned long) w->cap, (unsigned long) keep, (unsigned long) end);
+    }
+
+    memcpy(w->buf + w->fill, c->data, c->len);
+    w->crc = inkwave_crc32(w->crc, c->data, c->len);
+    w->fill += c->len;
+    release_chunk(r);
+  }
+
+  return 0;
+}
+
+static uint32_t read_addr(const char* p) {
+  return (uint8_t) p[0] | ((uint8_t) p[1] << 8) | ((uint32_t) (uint8_t) p[2] << 16);
+}
+
+// Buffer everything parse_tables() will look at. The tables are
+// found by following the same offsets parse_tables() does, without
+// checking them; anything that points past the end of the file
+// just means buffering the whole file and letting parse_tables()
+// report the error.
+static int read_tables(struct inkwave_model* model, struct stream_reader* r, struct stream_window* w) {
+  const struct waveform_data_header* header = model->header;
+  size_t size = header->filesize;
+  size_t need;
+  size_t modes;
+  size_t addr;
+  uint8_t xwia_len = 0;
+  uint16_t i;
+
+#define NEED(n) do { \
+    need = ((n) > size) ? size : (n); \
+    if(window_fill(model, r, w, need, 0) < 0) return -1; \
+  } while(0)
+
+  NEED(sizeof(struct waveform_data_header) + (size_t) header->trc + 3);
+
+  if(header->xwia) {
+    NEED((size_t) header->xwia + 1);
+    if(header->xwia < size) {
+      xwia_len = w->buf[header->xwia];
+    }
+    NEED((size_t) header->xwia + xwia_len + 2);
+  }
+
+  modes = (size_t) header->xwia + 1 + xwia_len + 1;
+  NEED(modes + 4 * ((size_t) header->mc + 1));
+
+  for(i=0; i <= header->mc; i++) {
+    if(modes + 4 * i + 3 > size) break;
+    addr = read_addr(w->buf + modes + 4 * i);
+    NEED(addr + 4 * ((size_t) header->trc + 1));
+  }
+
+#undef NEED
+
+  return 0;
+}
+
+struct stream_out {
+  int fd;
+  char* tables;
+  size_t pos; // where the next waveform block goes
+};
+
+static int write_at(struct inkwave_model* model, int fd, const char* buf, size_t len, size_t pos) {
+  ssize_t ret;
+
+  while(len) {
+    ret = pwrite(fd, buf, len, pos);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      if(errno == ESPIPE) {
+        return fail(model, "Streaming conversion needs a seekable output file");
+      }
+      return fail(model, "Error writing output file: %s", strerror(errno));
+    }
+    buf += ret;
+    len -= ret;
+    pos += ret;
+  }
+
+  return 0;
+}
+
+// Write the decoded waveform `wav` (8 byte block header already in
+// front of it) once, or once for each reference unless deduplicating.
+static int write_waveform(struct inkwave_model* model, struct stream_out* out, int flags, const char* block, uint32_t wav, const uint32_t* first, const uint32_t* refs) {
+  const struct inkwave_waveform* waveform = &model->waveforms[wav];
+  uint32_t tr_count = model->temp_range_count;
+  size_t tr_tables = sizeof(struct waveform_data_header) + tr_count + 1 + 8 * model->mode_count;
+  size_t len = 8 + waveform->state_count;
+  uint32_t i;
+
+  for(i=first[wav]; i < first[wav + 1]; i++) {
+    if(!(flags & INKWAVE_WRF_DEDUP) || i == first[wav]) {
+      if(write_at(model, out->fd, block, len, out->pos) < 0) {
+        return -1;
+      }
+      out->pos += len;
+    }
+    // the table entry points at the block header
+    if(put_table_entry(model, out->tables + tr_tables + 8 * refs[i], out->pos - len) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int inkwave_stream_wrf(struct inkwave_stream* stream, struct inkwave_model* model, struct inkwave_arena* arena, int flags, int out_fd) {
+  const struct waveform_data_header* header = &stream->header;
+  const char zero[4] = {0};
+  struct stream_reader reader;
+  struct stream_window win;
+  struct stream_out out;
+  struct inkwave_waveform* waveform;
+  pthread_t thread;
+  size_t refs_count;
+  uint32_t* first;
+  uint32_t* refs;
+  char* xwia;
+  char* block;
+  uint16_t be_state_count;
+  uint32_t i;
+  uint16_t m;
+  long state_count;
+  long payload_len;
+  int ret = -1;
+
+  memset(model, 0, sizeof(struct inkwave_model));
+  model->header = header;
+  model->size = header->filesize;
+
+  refs_count = (size_t) (header->mc + 1) * (header->trc + 1);
+
+  memset(&reader, 0, sizeof(reader));
+  reader.fd = stream->fd;
+  reader.remaining = header->filesize - sizeof(struct waveform_data_header);
+  reader.offset = sizeof(struct waveform_data_header);
+  reader.chunk_size = chunk_size(stream->buf_size);
+
+  win.cap = stream->buf_size;
+  win.buf = inkwave_arena_alloc(arena, win.cap);
+  block = inkwave_arena_alloc(arena, stream->buf_size);
+  out.tables = inkwave_arena_alloc(arena, table_size(header));
+  xwia = inkwave_arena_alloc(arena, 256);
+  first = inkwave_arena_alloc(arena, (refs_count + 1) * sizeof(uint32_t));
+  refs = inkwave_arena_alloc(arena, refs_count * sizeof(uint32_t));
+  for(i=0; i < STREAM_CHUNKS; i++) {
+    reader.chunks[i].data = inkwave_arena_alloc(arena, reader.chunk_size);
+    if(!reader.chunks[i].data) {
+      return fail(model, "Arena too small");
+    }
+  }
+  if(!win.buf || !block || !out.tables || !xwia || !first || !refs) {
+    return fail(model, "Arena too small");
+  }
+  if(win.cap < sizeof(struct waveform_data_header)) {
+    return fail(model, "Stream buffer of %lu bytes is too small", (unsigned long) win.cap);
+  }
+
+  // the header has already been read, the checksum field counts as zero
+  memcpy(win.buf, header, sizeof(struct waveform_data_header));
+  win.base = 0;
+  win.fill = sizeof(struct waveform_data_header);
+  win.crc = inkwave_crc32(0, zero, 4);
+  win.crc = inkwave_crc32(win.crc, win.buf + 4, win.fill - 4);
+
+  pthread_mutex_init(&reader.lock, NULL);
+  pthread_cond_init(&reader.cond, NULL);
+  if(pthread_create(&thread, NULL, reader_main, &reader) != 0) {
+    fail(model, "Failed to start reader thread");
+    goto destroy;
+  }
+
+  if(read_tables(model, &reader, &win) < 0) {
+    goto out;
+  }
+
+  model->data = win.buf;
+  if(parse_tables(model, arena) < 0) {
+    goto out;
+  }
+
+  // the window is about to move on, keep what we still need
+  memcpy(out.tables, header, sizeof(struct waveform_data_header));
+  memcpy(out.tables + sizeof(struct waveform_data_header), model->temps, model->temp_range_count + 1);
+  model->temps = (const uint8_t*) out.tables + sizeof(struct waveform_data_header);
+  if(model->xwia) {
+    memcpy(xwia, model->xwia, model->xwia_len);
+    model->xwia = xwia;
+  }
+
+  // every (mode, temperature range) using each waveform
+  memset(first, 0, (refs_count + 1) * sizeof(uint32_t));
+  for(i=0; i < refs_count; i++) {
+    first[model->wav_ids[i] + 1]++;
+  }
+  for(i=0; i < model->waveform_count; i++) {
+    first[i + 1] += first[i];
+  }
+  for(i=0; i < refs_count; i++) {
+    refs[first[model->wav_ids[i]]++] = i;
+  }
+  for(i=model->waveform_count; i > 0; i--) {
+    first[i] = first[i - 1];
+  }
+  first[0] = 0;
+
+  out.fd = out_fd;
+  out.pos = table_size(header);
+
+  for(m=0; m < model->mode_count; m++) {
+    if(put_table_entry(model, out.tables + sizeof(struct waveform_data_header) + model->temp_range_count + 1 + 8 * m,
+                       sizeof(struct waveform_data_header) + model->temp_range_count + 1 + 8 * model->mode_count
+                       + 8 * (size_t) m * model->temp_range_count) < 0) {
+      goto out;
+    }
+  }
+
+  for(i=0; i < model->waveform_count; i++) {
+    waveform = &model->waveforms[i];
+
+    if(window_fill(model, &reader, &win, (size_t) waveform->addr + waveform->len, waveform->addr) < 0) {
+      goto out;
+    }
+
+    payload_len = waveform_payload_len(model, waveform);
+    if(payload_len < 0) {
+      goto out;
+    }
+
+    state_count = count_waveform_states(win.buf + (waveform->addr - win.base), payload_len);
+    if(state_count > WRF_MAX_STATES) {
+      fail(model, "Waveform at 0x%x has %ld states, more than a .wrf can hold", waveform->addr, state_count);
+      goto out;
+    }
+    if((size_t) state_count + 8 > stream->buf_size) {
+      fail(model, "Waveform at 0x%x decodes to more than the %lu byte stream buffer", waveform->addr, (unsigned long) stream->buf_size);
+      goto out;
+    }
+    waveform->state_count = state_count;
+
+    // state count is a big-endian 16 bit value followed by 6 bytes of padding
+    be_state_count = htons((uint16_t) waveform->state_count);
+    memcpy(block, &be_state_count, sizeof(be_state_count));
+    memset(block + sizeof(be_state_count), 0, 8 - sizeof(be_state_count));
+    decode_waveform(win.buf + (waveform->addr - win.base), payload_len, block + 8);
+
+    if(write_waveform(model, &out, flags, block, i, first, refs) < 0) {
+      goto out;
+    }
+  }
+
+  // the last waveform ends at the end of the file so by now
+  // every byte has gone through the checksum
+  if(win.crc != header->checksum) {
+    fail(model, "Checksum error");
+    goto out;
+  }
+
+  if(write_at(model, out_fd, out.tables, table_size(header), 0) < 0) {
+    goto out;
+  }
+
+  ret = 0;
+
+ out:
+  pthread_mutex_lock(&reader.lock);
+  reader.stop = 1;
+  pthread_cond_broadcast(&reader.cond);
+  pthread_mutex_unlock(&reader.lock);
+  pthread_join(thread, NULL);
+
+ destroy:
+  pthread_cond_destroy(&reader.cond);
+  pthread_mutex_destroy(&reader.lock);
+
+  // the input is gone, waveforms can't be decoded from this model
+  model->data = NULL;
+  return ret;
+}